@@ -0,0 +1,172 @@
+/* test program: TVBOX_I8XX_BLT checks and ring bookkeeping, on the build host.
+ * no module or chipset needed, this runs tvbox_9xx_blt.h as the driver does */
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "tvbox_9xx.h"
+#include "tvbox_9xx_blt.h"
+
+/* a made up aperture: 4096 entries, the driver has [1920,1929), the client owns [2048,3072) */
+#define ENTRIES		4096
+#define DRV_FIRST	1920
+#define DRV_ENTRIES	9
+#define OWN_FIRST	2048
+#define OWN_COUNT	1024
+
+static int owns(void *ctx,unsigned int first,unsigned int count) {
+	(void)ctx;
+	return first >= OWN_FIRST && (first + count) <= (OWN_FIRST + OWN_COUNT);
+}
+
+static const struct blt_limits lim = { ENTRIES, DRV_FIRST, DRV_ENTRIES, owns, NULL };
+
+/* 32bpp fill of a w x h rectangle at (x,y) in a surface at entry 'entry' */
+static void color_blt(uint32_t *c,unsigned int entry,int pitch,int x,int y,int w,int h) {
+	c[0] = TVBOX_I8XX_XY_COLOR_BLT | TVBOX_I8XX_XY_BLT_WRITE_RGBA;
+	c[1] = (3U << 24) | (0xF0 << 16) | (pitch & 0xFFFF);
+	c[2] = ((uint32_t)y << 16) | (x & 0xFFFF);
+	c[3] = ((uint32_t)(y + h) << 16) | ((x + w) & 0xFFFF);
+	c[4] = entry << 12;
+	c[5] = 0x00FF00FF;
+}
+
+static int expect(const char *what,long got,long want) {
+	if (got == want)
+		return 0;
+
+	fprintf(stderr,"BUG! %s: got %ld, expected %ld\n",what,got,want);
+	return 1;
+}
+
+static int check_tests() {
+	uint32_t c[16];
+	int bad = 0;
+
+	color_blt(c,OWN_FIRST,4096,0,0,1024,16);
+	bad += expect("fill inside the client's space",blt_check(&lim,c,6),0);
+
+	c[6] = MI_NOOP;
+	bad += expect("fill plus MI_NOOP",blt_check(&lim,c,7),0);
+	bad += expect("truncated fill",blt_check(&lim,c,5),-EINVAL);
+
+	color_blt(c,OWN_FIRST,4096,0,0,1024,OWN_COUNT + 1);
+	bad += expect("fill running off the end of the client's space",blt_check(&lim,c,6),-EACCES);
+
+	color_blt(c,DRV_FIRST,4096,0,0,16,1);
+	bad += expect("fill over the driver's entries",blt_check(&lim,c,6),-EACCES);
+
+	color_blt(c,ENTRIES - 1,4096,0,0,1024,2);
+	bad += expect("fill past the aperture",blt_check(&lim,c,6),-EACCES);
+
+	color_blt(c,OWN_FIRST,-4096,0,0,16,16);
+	bad += expect("negative pitch",blt_check(&lim,c,6),-EACCES);
+
+	color_blt(c,OWN_FIRST,4096,8,8,-4,4);
+	bad += expect("x2 < x1",blt_check(&lim,c,6),-EACCES);
+
+	color_blt(c,OWN_FIRST,4096,0,0,16,16);
+	c[0] |= 1U << 11;	/* dst tiled */
+	bad += expect("tiled fill",blt_check(&lim,c,6),-EINVAL);
+
+	c[0] = (0x31U << 23) | 1;	/* MI_BATCH_BUFFER_START */
+	c[1] = OWN_FIRST << 12;
+	bad += expect("MI_BATCH_BUFFER_START",blt_check(&lim,c,2),-EINVAL);
+
+	/* copy: the source has to pass too */
+	c[0] = TVBOX_I8XX_XY_SRC_COPY_BLT | TVBOX_I8XX_XY_BLT_WRITE_RGBA;
+	c[1] = (3U << 24) | (0xCC << 16) | 4096;
+	c[2] = 0;
+	c[3] = (16U << 16) | 16;
+	c[4] = OWN_FIRST << 12;
+	c[5] = 0;
+	c[6] = 4096;
+	c[7] = (OWN_FIRST + 512) << 12;
+	bad += expect("copy inside the client's space",blt_check(&lim,c,8),0);
+
+	c[7] = 0;
+	bad += expect("copy from stolen memory",blt_check(&lim,c,8),-EACCES);
+
+	c[7] = (OWN_FIRST + 512) << 12;
+	c[5] = (0xFFFFU << 16);	/* src y1 = -1 */
+	bad += expect("copy from a negative source row",blt_check(&lim,c,8),-EACCES);
+
+	return bad;
+}
+
+/* a 64 byte ring is 16 dwords, so wrapping comes quickly */
+static int ring_tests() {
+	uint32_t mem[16],hws[64];
+	struct blt_ring r = { mem, sizeof(mem), 0 };
+	unsigned int head = 0,seq,i;
+	int bad = 0;
+
+	memset(hws,0,sizeof(hws));
+
+	/* the tail has to stay a qword behind the head: 14 dwords fit in an empty ring, 15 don't */
+	bad += expect("room for 14 dwords in an empty ring",blt_ring_room(&r,head,14),1);
+	bad += expect("room for 15 dwords in an empty ring",blt_ring_room(&r,head,15),0);
+
+	/* batches the way TVBOX_I8XX_BLT emits them: padded to a qword, flush, store seqno */
+	for (seq=1;seq <= 20;seq++) {
+		unsigned int n = 2 + 4;
+
+		if (!blt_ring_room(&r,head,n)) {
+			/* the mock GPU catches up, as the real one would while ring_begin() waits */
+			head = blt_ring_execute(&r,head,r.tail,hws);
+			if (!blt_ring_room(&r,head,n)) {
+				fprintf(stderr,"BUG! no room in an idle ring for batch %u\n",seq);
+				return bad + 1;
+			}
+		}
+
+		blt_ring_wrap(&r,n);
+		if ((r.tail + (n << 2)) > r.size) {
+			fprintf(stderr,"BUG! batch %u would run off the end of the ring\n",seq);
+			return bad + 1;
+		}
+
+		blt_ring_emit(&r,MI_NOOP);
+		blt_ring_emit(&r,MI_NOOP);
+		blt_ring_emit(&r,MI_FLUSH);
+		blt_ring_emit(&r,MI_STORE_DWORD_INDEX);
+		blt_ring_emit(&r,TVBOX_I8XX_HWS_SEQNO << 2);
+		blt_ring_emit(&r,seq);
+	}
+
+	head = blt_ring_execute(&r,head,r.tail,hws);
+	bad += expect("head caught up with the tail",head,r.tail);
+	bad += expect("last sequence number in the status page",hws[TVBOX_I8XX_HWS_SEQNO],20);
+	for (i=0;i < 64;i++) {
+		if (i != TVBOX_I8XX_HWS_SEQNO && hws[i] != 0) {
+			fprintf(stderr,"BUG! status page dword %u written\n",i);
+			bad++;
+		}
+	}
+
+	/* a blit is stepped over by its length, not executed */
+	head = r.tail = 0;
+	color_blt(mem,OWN_FIRST,4096,0,0,1,1);
+	r.tail = 24;
+	bad += expect("head after a blit",blt_ring_execute(&r,head,r.tail,hws),r.tail);
+
+	return bad;
+}
+
+int main() {
+	int bad = 0;
+
+	printf("Checking TVBOX_I8XX_BLT command validation\n");
+	bad += check_tests();
+	printf("Checking ring space accounting and the mock command streamer\n");
+	bad += ring_tests();
+
+	if (bad != 0) {
+		fprintf(stderr,"%d checks failed\n",bad);
+		return 1;
+	}
+
+	printf("All good\n");
+	return 0;
+}
@@ -1,13 +1,19 @@
 /* test program: get info */
+#define _XOPEN_SOURCE 500	/* pread(), pwrite() */
+#define _DEFAULT_SOURCE		/* pwritev(), preadv() */
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 
 #include "tvbox_9xx.h"
@@ -38,11 +44,17 @@ static int show_info(int fd) {
 	printf("MMIO:                  %-5luKB @ 0x%08lX\n",nfo.mmio_size>>10ULL,nfo.mmio_base);
 	printf("Driver pgtable:        %-5luKB @ 0x%08lX\n",nfo.pgtable_size>>10ULL,nfo.pgtable_base);
 	printf("H/W status:            %-5luKB @ 0x%08lX\n",nfo.hwst_size>>10ULL,nfo.hwst_base);
+	printf("Driver's GTT entries:  %-5u   @ entry %u\n",nfo.drv_entries,nfo.drv_entry);
 	printf("Chipset:               %s\n",get_chipset_name(nfo.chipset));
 
 	return 0;
 }
 
+/* status page and ring entries. the driver ignores writes there, and so should we */
+static int drv_entry(unsigned int i) {
+	return i >= nfo.drv_entry && i < (nfo.drv_entry + nfo.drv_entries);
+}
+
 static int open_again() {
 	int fd2 = open("/dev/tvbox_i8xx",O_RDWR);
 	if (fd2 >= 0) {
@@ -53,6 +65,41 @@ static int open_again() {
 	return 0;
 }
 
+/* read one of the driver's boolean module parameters */
+static int module_flag(const char *name) {
+	char path[128];
+	FILE *fp;
+	int c = 0;
+
+	sprintf(path,"/sys/module/tvbox_9xx/parameters/%s",name);
+	if ((fp = fopen(path,"r")) != NULL) {
+		c = fgetc(fp);
+		fclose(fp);
+	}
+
+	return (c == 'Y' || c == '1');
+}
+
+/* was the module loaded with multi_client=1? */
+static int multi_client() {
+	return module_flag("multi_client");
+}
+
+/* read one of the driver's numeric module parameters (counters), 0 if not there */
+static unsigned long module_counter(const char *name) {
+	unsigned long v = 0;
+	char path[128];
+	FILE *fp;
+
+	sprintf(path,"/sys/module/tvbox_9xx/parameters/%s",name);
+	if ((fp = fopen(path,"r")) != NULL) {
+		if (fscanf(fp,"%lu",&v) != 1) v = 0;
+		fclose(fp);
+	}
+
+	return v;
+}
+
 static void countdown(int c) {
 	while (c > 0) {
 		printf("%d... ",c--);
@@ -62,6 +109,18 @@ static void countdown(int c) {
 	printf("\n");
 }
 
+static double now_ms() {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return ((double)tv.tv_sec * 1000.0) + ((double)tv.tv_usec / 1000.0);
+}
+
+/* ordering rule for the write-combined GTT mapping: fence, then posting read */
+static void gtt_flush(volatile uint32_t *gtt,unsigned int last) {
+	__sync_synchronize();
+	(void)gtt[last];
+}
+
 static int def_pgtable(int fd) {
 	int r = ioctl(fd,TVBOX_I8XX_SET_DEFAULT_PGTABLE);
 	if (r) fprintf(stderr,"Failed to TVBOX_I8XX_SET_DEFAULT_PGTABLE, %s\n",strerror(errno));
@@ -87,8 +146,8 @@ int main() {
 		return 1;
 	}
 
-	/* CHECK: I can't open this concurrently, right? */
-	if (open_again()) return 2;
+	/* CHECK: I can't open this concurrently, right? (unless the driver is in multi-client mode) */
+	if (open_again() != multi_client()) return 2;
 
 	printf("Device open, asking info\n");
 	if (show_info(fd)) return 2;
@@ -97,13 +156,16 @@ int main() {
 	countdown(2);
 	if (def_pgtable(fd)) return 3;
 
-	printf("I'm going to test switching to VGA BIOS pgtable\n");
-	countdown(2);
-	if (vgabios_pgtable(fd)) return 3;
+	/* whole-table switches are refused while several clients share the table */
+	if (!multi_client()) {
+		printf("I'm going to test switching to VGA BIOS pgtable\n");
+		countdown(2);
+		if (vgabios_pgtable(fd)) return 3;
 
-	printf("I'm going to make driver's pgtable active again\n");
-	countdown(2);
-	if (pgtable_activate(fd)) return 3;
+		printf("I'm going to make driver's pgtable active again\n");
+		countdown(2);
+		if (pgtable_activate(fd)) return 3;
+	}
 
 	/* test lseek(), make sure aligned one work and unaligned ones fail */
 	printf("lseek test in progress\n");
@@ -167,9 +229,6 @@ int main() {
 				fprintf(stderr,"BUG! read from offset %d worked but only %d bytes read\n",x,r);
 				return 1;
 			}
-
-			if (word != 0)
-				printf("%lu: 0x%08lX\n",(unsigned long)(x>>2),(unsigned long)word);
 		}
 		
 		/* make sure lseek(end) == end but we can't read */
@@ -187,7 +246,7 @@ int main() {
 	/* multiple read test: see if we can pass in an array of uint32_t and get back corresponding pages */
 	{
 		uint32_t words[256];
-		int x,i;
+		int x;
 
 		for (x=0;x < nfo.pgtable_size;x += sizeof(words)) {
 			if (lseek(fd,x,SEEK_SET) != x) {
@@ -204,15 +263,209 @@ int main() {
 				fprintf(stderr,"BUG! read from offset %d incomplete\n",x);
 				return 1;
 			}
+		}
+	}
+
+	/* extent dump: print the table as linear runs, and check them against a plain read.
+	 * the extent array is kept small on purpose, so TVBOX_I8XX_DUMP has to be called again */
+	{
+		unsigned int entries = nfo.pgtable_size/sizeof(uint32_t);
+		uint32_t *words = malloc(nfo.pgtable_size);
+		struct tvbox_i8xx_extent ext[8];
+		struct tvbox_i8xx_dump d;
+		unsigned int total = 0;
+		int i,n;
+
+		if (words == NULL) return 1;
+		if (pread(fd,words,nfo.pgtable_size,0) != nfo.pgtable_size) {
+			fprintf(stderr,"pread failed, %s\n",strerror(errno));
+			return 1;
+		}
+
+		d.start = 0;
+		d.count = 0;
+		d.max = 8;
+		d.extents = ext;
+		d.next = 0;
+		do {
+			if ((n = ioctl(fd,TVBOX_I8XX_DUMP,&d)) < 0) {
+				fprintf(stderr,"Failed to TVBOX_I8XX_DUMP, %s\n",strerror(errno));
+				return 1;
+			}
+
+			for (i=0;i < n;i++) {
+				unsigned int k;
 
-			for (i=0;i < (r/sizeof(uint32_t));i++) {
-				uint32_t word = words[i];
-				if (word != 0)
-					printf("%lu: 0x%08lX\n",
-						(unsigned long)((x>>2)+i),
-						(unsigned long)word);
+				printf("%u-%u: 0x%08X + 0x%X each, flags 0x%03X\n",ext[i].start,ext[i].start+ext[i].count-1,
+					ext[i].base,ext[i].stride,ext[i].flags);
+
+				for (k=0;k < ext[i].count;k++) {
+					if (words[ext[i].start+k] != ((ext[i].base + (k * ext[i].stride)) | ext[i].flags)) {
+						fprintf(stderr,"BUG! extent dump disagrees with read() at %u\n",ext[i].start+k);
+						return 1;
+					}
+				}
 			}
+
+			total += n;
+			d.start = d.next;
+		} while (d.next < entries);
+
+		printf("%u entries in %u extents\n",entries,total);
+		free(words);
+	}
+
+	/* allocator test: three ranges, free the middle one, a smaller request should land in the hole */
+	{
+		unsigned int entries = nfo.pgtable_size/sizeof(uint32_t);
+		unsigned int reserved = (nfo.stolen_size - nfo.pgtable_size) >> 12;
+		struct tvbox_i8xx_alloc a[3],h;
+		int i;
+
+		for (i=0;i < 3;i++) {
+			a[i].count = 64;
+			a[i].align = 16;
+			if (ioctl(fd,TVBOX_I8XX_ALLOC,&a[i])) {
+				fprintf(stderr,"Failed to TVBOX_I8XX_ALLOC, %s\n",strerror(errno));
+				return 1;
+			}
+			if (a[i].entry < reserved || (a[i].entry & 15) || (a[i].entry + 64) > entries) {
+				fprintf(stderr,"BUG! TVBOX_I8XX_ALLOC gave out entry %u\n",a[i].entry);
+				return 1;
+			}
+			printf("Allocated 64 entries @ %u\n",a[i].entry);
+		}
+
+		if (ioctl(fd,TVBOX_I8XX_FREE,a[1].entry)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_FREE, %s\n",strerror(errno));
+			return 1;
+		}
+
+		h.count = 32;
+		h.align = 1;
+		if (ioctl(fd,TVBOX_I8XX_ALLOC,&h) || h.entry != a[1].entry) {
+			fprintf(stderr,"BUG! best fit did not reuse the hole at %u\n",a[1].entry);
+			return 1;
+		}
+
+		h.count = entries;
+		if (ioctl(fd,TVBOX_I8XX_ALLOC,&h) == 0 || errno != ENOSPC) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_ALLOC handed out the whole table\n");
+			return 1;
+		}
+
+		/* the rest is given back on close */
+	}
+
+	/* multi-client test: a second client may only write inside the ranges it allocates */
+	if (multi_client()) {
+		int fd2 = open("/dev/tvbox_i8xx",O_RDWR);
+		struct tvbox_i8xx_alloc a;
+		uint32_t w = 0;
+
+		if (fd2 < 0) {
+			fprintf(stderr,"Cannot open second client, %s\n",strerror(errno));
+			return 1;
+		}
+
+		a.count = 16;
+		a.align = 1;
+		if (ioctl(fd2,TVBOX_I8XX_ALLOC,&a)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_ALLOC, %s\n",strerror(errno));
+			return 1;
+		}
+
+		lseek(fd2,a.entry*4,SEEK_SET);
+		if (write(fd2,&w,sizeof(w)) != sizeof(w)) {
+			fprintf(stderr,"BUG! second client cannot write its own range\n");
+			return 1;
+		}
+
+		lseek(fd2,(a.entry+16)*4,SEEK_SET);
+		if (write(fd2,&w,sizeof(w)) >= 0 || errno != EACCES) {
+			fprintf(stderr,"BUG! second client wrote outside its range\n");
+			return 1;
+		}
+
+		close(fd2);
+	}
+
+	/* a range given back with a buffer still bound in it: the binding goes with the range,
+	 * so unbinding afterwards must leave the next owner's entries alone */
+	if (multi_client()) {
+		int fd2 = open("/dev/tvbox_i8xx",O_RDWR);
+		unsigned char *raw = malloc(17 * 4096);
+		struct tvbox_i8xx_alloc a,a2;
+		struct tvbox_i8xx_bind b;
+		uint32_t w[16],pte[16];
+		unsigned int x,tries;
+
+		if (fd2 < 0 || raw == NULL) {
+			fprintf(stderr,"Cannot open second client, %s\n",strerror(errno));
+			return 1;
+		}
+
+		a.count = 16;
+		a.align = 16;
+		if (ioctl(fd,TVBOX_I8XX_ALLOC,&a)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_ALLOC, %s\n",strerror(errno));
+			return 1;
+		}
+
+		b.addr = ((unsigned long)raw + 4095UL) & ~4095UL;
+		b.size = 16 * 4096;
+		b.entry = a.entry;
+		if (ioctl(fd,TVBOX_I8XX_BIND,&b) != 16) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_BIND, %s\n",strerror(errno));
+			return 1;
 		}
+		if (ioctl(fd,TVBOX_I8XX_FREE,a.entry)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_FREE, %s\n",strerror(errno));
+			return 1;
+		}
+
+		/* best fit, so the exact hole comes back soon enough */
+		for (tries=0;tries < 64;tries++) {
+			a2.count = 16;
+			a2.align = 16;
+			if (ioctl(fd2,TVBOX_I8XX_ALLOC,&a2) || a2.entry == a.entry)
+				break;
+		}
+		if (a2.entry != a.entry) {
+			fprintf(stderr,"BUG! the freed range at %u never came back\n",a.entry);
+			return 1;
+		}
+
+		/* the second client fills it with the first page */
+		lseek(fd2,0,SEEK_SET);
+		read(fd2,w,sizeof(uint32_t));
+		for (x=1;x < 16;x++) w[x] = w[0];
+		lseek(fd2,a2.entry*4,SEEK_SET);
+		if (write(fd2,w,sizeof(w)) != sizeof(w)) {
+			fprintf(stderr,"BUG! second client cannot write the range it got\n");
+			return 1;
+		}
+
+		if (ioctl(fd,TVBOX_I8XX_UNBIND,b.entry) == 0 || errno != ENOENT) {
+			fprintf(stderr,"BUG! the binding outlived TVBOX_I8XX_FREE\n");
+			return 1;
+		}
+
+		lseek(fd2,a2.entry*4,SEEK_SET);
+		read(fd2,pte,sizeof(pte));
+		if (memcmp(pte,w,sizeof(w))) {
+			fprintf(stderr,"BUG! first client's old binding wiped the second client's entries\n");
+			return 1;
+		}
+
+		close(fd2);
+		free(raw);
+	}
+
+	/* everything below writes wherever it likes, which only the single-client driver allows */
+	if (multi_client()) {
+		close(fd);
+		return 0;
 	}
 
 	printf("I'm going to repeat the first page table entry across all.\n");
@@ -245,11 +498,13 @@ int main() {
 	{
 		uint32_t w,nw;
 		unsigned int x;
+		double t;
 
 		lseek(fd,0,SEEK_SET);
 		read(fd,&w,sizeof(w));
 		printf("Repeating 0x%08lX\n",(unsigned long)w);
 
+		t = now_ms();
 		for (x=0;x < (nfo.pgtable_size/sizeof(uint32_t));x++) {
 			if (lseek(fd,x*4,SEEK_SET) != (x*4)) {
 				fprintf(stderr,"BUG: lseek(%d) != %d\n",x*4,x*4);
@@ -263,16 +518,19 @@ int main() {
 				return 1;
 			}
 		}
+		printf("  lseek+write:  %.3fms\n",now_ms() - t);
 	}
 	sleep(1);
 	{
 		uint32_t w,nw;
 		unsigned int x;
+		double t;
 
 		lseek(fd,0,SEEK_SET);
 		read(fd,&w,sizeof(w));
 		printf("Repeating 0x%08lX\n",(unsigned long)w);
 
+		t = now_ms();
 		for (x=0;x < (nfo.pgtable_size/sizeof(uint32_t));x++) {
 			if (lseek(fd,x*4,SEEK_SET) != (x*4)) {
 				fprintf(stderr,"BUG: lseek(%d) != %d\n",x*4,x*4);
@@ -286,26 +544,937 @@ int main() {
 				return 1;
 			}
 		}
+		printf("  lseek+write:  %.3fms\n",now_ms() - t);
+	}
+	sleep(1);
+
+	/* the same two streak patterns again, generated in the kernel by TVBOX_I8XX_FILL */
+	{
+		struct tvbox_i8xx_fill f;
+		unsigned int x;
+		uint32_t w;
+		double t;
+
+		lseek(fd,0,SEEK_SET);
+		read(fd,&w,sizeof(w));
+
+		memset(&f,0,sizeof(f));
+		f.start = 0;
+		f.count = nfo.pgtable_size/sizeof(uint32_t);
+		f.base = w;
+		f.stride = 4096;
+
+		printf("Fill: w + (x>>1)*4096\n");
+		f.repeat = 2;
+		f.period = 0;
+		t = now_ms();
+		if (ioctl(fd,TVBOX_I8XX_FILL,&f) != (int)f.count) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_FILL, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("  fill ioctl:   %.3fms\n",now_ms() - t);
+		sleep(1);
+
+		printf("Fill: w + (x&7)*4096\n");
+		f.repeat = 1;
+		f.period = 8;
+		t = now_ms();
+		if (ioctl(fd,TVBOX_I8XX_FILL,&f) != (int)f.count) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_FILL, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("  fill ioctl:   %.3fms\n",now_ms() - t);
+
+		for (x=0;x < 64;x++) {
+			uint32_t rw;
+			lseek(fd,x*4,SEEK_SET);
+			read(fd,&rw,sizeof(rw));
+			if (rw != w + ((x&7) * 4096)) {
+				fprintf(stderr,"BUG! fill entry %u is 0x%08lX\n",x,(unsigned long)rw);
+				return 1;
+			}
+		}
+
+		/* must not run off the end of the table */
+		f.start = 1;
+		if (ioctl(fd,TVBOX_I8XX_FILL,&f) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_FILL accepted a range past the end\n");
+			return 1;
+		}
+	}
+	sleep(1);
+
+	/* scatter test: point every 8th entry back at the first page in one ioctl, and read back to check */
+	{
+		unsigned int x,count=0,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_gtt_entry *pairs = malloc(sizeof(*pairs) * (entries/8 + 1));
+		struct tvbox_i8xx_scatter sc;
+		uint32_t w;
+		double t;
+		int r;
+
+		if (pairs == NULL) return 1;
+
+		lseek(fd,0,SEEK_SET);
+		read(fd,&w,sizeof(w));
+
+		for (x=0;x < entries;x += 8) {
+			pairs[count].entry = x;
+			pairs[count].pte = w;
+			count++;
+		}
+
+		memset(&sc,0,sizeof(sc));
+		sc.count = count;
+		sc.pairs = pairs;
+
+		t = now_ms();
+		r = ioctl(fd,TVBOX_I8XX_SCATTER,&sc);
+		if (r != (int)count) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_SCATTER returned %d, expected %u (%s)\n",r,count,strerror(errno));
+			return 1;
+		}
+		printf("Scatter: %u entries in %.3fms\n",count,now_ms() - t);
+
+		for (x=0;x < entries;x += 8) {
+			uint32_t rw;
+			lseek(fd,x*4,SEEK_SET);
+			read(fd,&rw,sizeof(rw));
+			if (rw != w && !drv_entry(x)) {
+				fprintf(stderr,"BUG! scatter entry %u is 0x%08lX\n",x,(unsigned long)rw);
+				return 1;
+			}
+		}
+
+		/* one bad index must reject the whole batch */
+		pairs[count-1].entry = entries;
+		if (ioctl(fd,TVBOX_I8XX_SCATTER,&sc) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_SCATTER accepted an out of range entry\n");
+			return 1;
+		}
+
+		free(pairs);
+	}
+	sleep(1);
+
+	/* the status page and ring entries keep pointing where the driver put them */
+	if (nfo.drv_entries != 0) {
+		struct tvbox_i8xx_bind b;
+		uint32_t before,after,w = 0;
+
+		pread(fd,&before,sizeof(before),nfo.drv_entry * 4);
+		if (pwrite(fd,&w,sizeof(w),nfo.drv_entry * 4) != sizeof(w)) {
+			fprintf(stderr,"Cannot write entry %u, %s\n",nfo.drv_entry,strerror(errno));
+			return 1;
+		}
+		pread(fd,&after,sizeof(after),nfo.drv_entry * 4);
+		if (after != before) {
+			fprintf(stderr,"BUG! write() replaced driver entry %u with 0x%08X\n",nfo.drv_entry,after);
+			return 1;
+		}
+
+		b.addr = (unsigned long)&w & ~4095UL;
+		b.size = 4096;
+		b.entry = nfo.drv_entry;
+		if (ioctl(fd,TVBOX_I8XX_BIND,&b) >= 0 || errno != EBUSY) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_BIND over the driver's entries\n");
+			return 1;
+		}
+	}
+
+	/* staged test: regenerate the whole table (unchanged) plus a handful of real changes,
+	 * and make sure only the real changes get committed */
+	{
+		unsigned int x,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_commit c;
+		struct tvbox_i8xx_fill f;
+		uint32_t w;
+
+		lseek(fd,0,SEEK_SET);
+		read(fd,&w,sizeof(w));
+
+		if (ioctl(fd,TVBOX_I8XX_SET_STAGED,1)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_SET_STAGED, %s\n",strerror(errno));
+			return 1;
+		}
+
+		memset(&f,0,sizeof(f));
+		f.count = entries;
+		f.base = w;
+		f.stride = 4096;
+		f.period = 8;
+		ioctl(fd,TVBOX_I8XX_FILL,&f);
+
+		for (x=0;x < 10;x++) {
+			lseek(fd,((x*8)+1)*4,SEEK_SET);
+			write(fd,&w,sizeof(w));
+		}
+
+		if (ioctl(fd,TVBOX_I8XX_COMMIT,&c)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_COMMIT, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("Commit: %u entries, %u bytes\n",c.entries,c.bytes);
+		if (c.entries != 10 || c.bytes != 40) {
+			fprintf(stderr,"BUG! expected 10 entries committed\n");
+			return 1;
+		}
+
+		ioctl(fd,TVBOX_I8XX_SET_STAGED,0);
+	}
+	sleep(1);
+
+	/* vblank queue test: queue a batch, wait for it with poll(), check the status */
+	{
+		struct tvbox_i8xx_gtt_entry pairs[16];
+		struct tvbox_i8xx_queue_status qs;
+		struct tvbox_i8xx_scatter sc;
+		struct pollfd pfd;
+		unsigned int x;
+		uint32_t w;
+		double t;
+		int seq;
+
+		lseek(fd,0,SEEK_SET);
+		read(fd,&w,sizeof(w));
+
+		for (x=0;x < 16;x++) {
+			pairs[x].entry = (x*8)+2;
+			pairs[x].pte = w;
+		}
+
+		memset(&sc,0,sizeof(sc));
+		sc.count = 16;
+		sc.pairs = pairs;
+
+		t = now_ms();
+		seq = ioctl(fd,TVBOX_I8XX_QUEUE,&sc);
+		if (seq < 0) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_QUEUE, %s\n",strerror(errno));
+			return 1;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd,1,1000) != 1 || !(pfd.revents & POLLIN)) {
+			fprintf(stderr,"BUG! queued batch %d never completed\n",seq);
+			return 1;
+		}
+		printf("Queued batch %d applied after %.3fms (vblank timeouts so far: %lu)\n",seq,now_ms() - t,
+			module_counter("vblank_timeouts"));
+
+		if (ioctl(fd,TVBOX_I8XX_QUEUE_STATUS,&qs) || qs.completed != (unsigned int)seq) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_QUEUE_STATUS does not show batch %d completed\n",seq);
+			return 1;
+		}
+
+		/* acknowledged, so poll() should not say POLLIN anymore */
+		pfd.revents = 0;
+		if (poll(&pfd,1,0) != 0 && (pfd.revents & POLLIN)) {
+			fprintf(stderr,"BUG! poll() still reports POLLIN after status\n");
+			return 1;
+		}
 	}
 	sleep(1);
 
+	/* bind test: pin 16 pages of our own memory into the top of the aperture */
+	{
+		unsigned int x,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_bind b;
+		unsigned char *raw = malloc(17 * 4096);
+		uint32_t pte[16];
+		int r;
+
+		if (raw == NULL) return 1;
+
+		b.addr = ((unsigned long)raw + 4095UL) & ~4095UL;
+		b.size = 16 * 4096;
+		b.entry = entries - 16;
+		memset((void*)b.addr,0x55,b.size);
+
+		r = ioctl(fd,TVBOX_I8XX_BIND,&b);
+		if (r != 16) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_BIND, %s\n",strerror(errno));
+			return 1;
+		}
+
+		lseek(fd,b.entry*4,SEEK_SET);
+		read(fd,pte,sizeof(pte));
+		for (x=0;x < 16;x++) {
+			if (!(pte[x] & 1)) {
+				fprintf(stderr,"BUG! bound entry %u is not valid (0x%08lX)\n",b.entry+x,(unsigned long)pte[x]);
+				return 1;
+			}
+			printf("Bound %u: 0x%08lX\n",b.entry+x,(unsigned long)pte[x]);
+		}
+
+		/* overlapping binds are refused */
+		if (ioctl(fd,TVBOX_I8XX_BIND,&b) >= 0 || errno != EBUSY) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_BIND allowed an overlapping bind\n");
+			return 1;
+		}
+
+		if (ioctl(fd,TVBOX_I8XX_UNBIND,b.entry)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_UNBIND, %s\n",strerror(errno));
+			return 1;
+		}
+		if (ioctl(fd,TVBOX_I8XX_UNBIND,b.entry) == 0 || errno != ENOENT) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_UNBIND twice worked\n");
+			return 1;
+		}
+
+		free(raw);
+	}
+
+	/* registered buffer test: register 32 pages once, then map different parts of it
+	 * at the top of the aperture like a per-frame remap would */
+	{
+		unsigned int x,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_map_buffer mb;
+		struct tvbox_i8xx_register rg;
+		unsigned char *raw = malloc(33 * 4096);
+		uint32_t a[8],b[8];
+		double t;
+		int h;
+
+		if (raw == NULL) return 1;
+
+		rg.addr = ((unsigned long)raw + 4095UL) & ~4095UL;
+		rg.size = 32 * 4096;
+		memset((void*)rg.addr,0xAA,rg.size);
+
+		h = ioctl(fd,TVBOX_I8XX_REGISTER,&rg);
+		if (h <= 0) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_REGISTER, %s\n",strerror(errno));
+			return 1;
+		}
+
+		mb.handle = h;
+		mb.entry = entries - 8;
+		mb.count = 8;
+
+		mb.first = 0;
+		if (ioctl(fd,TVBOX_I8XX_MAP_BUFFER,&mb) != 8) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_MAP_BUFFER, %s\n",strerror(errno));
+			return 1;
+		}
+		lseek(fd,mb.entry*4,SEEK_SET);
+		read(fd,a,sizeof(a));
+
+		t = now_ms();
+		for (x=0;x < 1000;x++) {
+			mb.first = (x & 1) ? 8 : 0;
+			ioctl(fd,TVBOX_I8XX_MAP_BUFFER,&mb);
+		}
+		printf("1000 buffer remaps in %.3fms\n",now_ms() - t);
+
+		mb.first = 8;
+		ioctl(fd,TVBOX_I8XX_MAP_BUFFER,&mb);
+		lseek(fd,mb.entry*4,SEEK_SET);
+		read(fd,b,sizeof(b));
+		if (!memcmp(a,b,sizeof(a))) {
+			fprintf(stderr,"BUG! mapping another part of the buffer changed nothing\n");
+			return 1;
+		}
+
+		/* past the end of the buffer */
+		mb.first = 25;
+		if (ioctl(fd,TVBOX_I8XX_MAP_BUFFER,&mb) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_MAP_BUFFER mapped past the end of the buffer\n");
+			return 1;
+		}
+
+		if (ioctl(fd,TVBOX_I8XX_UNREGISTER,h)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_UNREGISTER, %s\n",strerror(errno));
+			return 1;
+		}
+
+		free(raw);
+	}
+
+	/* parallel pwrite test: four processes share this fd (and so its file position) and
+	 * rewrite disjoint quarters of the top of the table with what's already there */
+	{
+		unsigned int entries = nfo.pgtable_size/sizeof(uint32_t);
+		unsigned int quarter = 1024,base = entries - (4 * quarter);
+		uint32_t *orig = malloc(4 * quarter * sizeof(uint32_t));
+		uint32_t *chk = malloc(4 * quarter * sizeof(uint32_t));
+		int i,st,bad = 0;
+		double t;
+
+		if (orig == NULL || chk == NULL) return 1;
+
+		if (pread(fd,orig,4 * quarter * 4,base * 4) != (4 * quarter * 4)) {
+			fprintf(stderr,"pread failed, %s\n",strerror(errno));
+			return 1;
+		}
+
+		t = now_ms();
+		for (i=0;i < 4;i++) {
+			if (fork() == 0) {
+				unsigned int x,ofs = (base + (i * quarter)) * 4;
+
+				for (x=0;x < 100;x++) {
+					if (pwrite(fd,orig + (i * quarter),quarter * 4,ofs) != (quarter * 4))
+						_exit(1);
+				}
+				_exit(0);
+			}
+		}
+		for (i=0;i < 4;i++) {
+			if (wait(&st) < 0 || !WIFEXITED(st) || WEXITSTATUS(st) != 0)
+				bad++;
+		}
+		printf("4 processes x 100 pwrite(%u entries) in %.3fms\n",quarter,now_ms() - t);
+
+		if (bad) {
+			fprintf(stderr,"BUG! %d pwrite() workers failed\n",bad);
+			return 1;
+		}
+		if (pread(fd,chk,4 * quarter * 4,base * 4) != (4 * quarter * 4) || memcmp(orig,chk,4 * quarter * 4)) {
+			fprintf(stderr,"BUG! table changed after parallel pwrite of the same values\n");
+			return 1;
+		}
+
+		free(orig);
+		free(chk);
+	}
+
+	/* vectored I/O: pwritev() the last 8 entries from two buffers split mid-word, preadv() them back */
+	{
+		unsigned int entries = nfo.pgtable_size/sizeof(uint32_t);
+		uint32_t a[8],b[8],c[8];
+		struct iovec v[2];
+
+		pread(fd,a,sizeof(a),(entries - 8) * 4);
+		memcpy(b,a,sizeof(a));
+
+		v[0].iov_base = b;			v[0].iov_len = 6;
+		v[1].iov_base = (char*)b + 6;		v[1].iov_len = sizeof(b) - 6;
+		if (pwritev(fd,v,2,(entries - 8) * 4) != sizeof(b)) {
+			fprintf(stderr,"pwritev failed, %s\n",strerror(errno));
+			return 1;
+		}
+
+		memset(c,0,sizeof(c));
+		v[0].iov_base = c;			v[0].iov_len = 10;
+		v[1].iov_base = (char*)c + 10;		v[1].iov_len = sizeof(c) - 10;
+		if (preadv(fd,v,2,(entries - 8) * 4) != sizeof(c) || memcmp(a,c,sizeof(a))) {
+			fprintf(stderr,"BUG! preadv did not return what pwritev wrote\n");
+			return 1;
+		}
+	}
+
+	/* copy test: overlapping TVBOX_I8XX_COPY must behave like memmove() */
+	{
+		unsigned int entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_copy cp;
+		struct tvbox_i8xx_fill f;
+		uint32_t a[32],b[32];
+
+		/* something with a different value in every entry */
+		memset(&f,0,sizeof(f));
+		f.start = entries - 32;
+		f.count = 32;
+		f.base = nfo.stolen_base;
+		f.stride = 4096;
+		f.flags = 1;
+		ioctl(fd,TVBOX_I8XX_FILL,&f);
+		pread(fd,a,sizeof(a),(entries - 32) * 4);
+
+		cp.src = entries - 32;
+		cp.dst = entries - 28;
+		cp.count = 16;
+		if (ioctl(fd,TVBOX_I8XX_COPY,&cp) != 16) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_COPY, %s\n",strerror(errno));
+			return 1;
+		}
+
+		memmove(a + 4,a,16 * sizeof(uint32_t));
+		pread(fd,b,sizeof(b),(entries - 32) * 4);
+		if (memcmp(a,b,sizeof(a))) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_COPY forward overlap is not memmove()\n");
+			return 1;
+		}
+
+		cp.src = entries - 28;
+		cp.dst = entries - 32;
+		ioctl(fd,TVBOX_I8XX_COPY,&cp);
+		memmove(a,a + 4,16 * sizeof(uint32_t));
+		pread(fd,b,sizeof(b),(entries - 32) * 4);
+		if (memcmp(a,b,sizeof(a))) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_COPY backward overlap is not memmove()\n");
+			return 1;
+		}
+
+		cp.dst = entries - 8;
+		if (ioctl(fd,TVBOX_I8XX_COPY,&cp) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_COPY ran past the end of the table\n");
+			return 1;
+		}
+	}
+
+	/* mirror test: a ring of 8 pages followed by two more copies of it */
+	{
+		unsigned int entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_mirror mi;
+		struct tvbox_i8xx_fill f;
+		uint32_t w[24];
+		int i;
+
+		memset(&f,0,sizeof(f));
+		f.start = entries - 24;
+		f.count = 8;
+		f.base = nfo.stolen_base;
+		f.stride = 4096;
+		f.flags = 1;
+		ioctl(fd,TVBOX_I8XX_FILL,&f);
+
+		mi.entry = entries - 24;
+		mi.count = 8;
+		mi.copies = 3;
+		if (ioctl(fd,TVBOX_I8XX_MIRROR,&mi) != 16) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_MIRROR, %s\n",strerror(errno));
+			return 1;
+		}
+
+		pread(fd,w,sizeof(w),(entries - 24) * 4);
+		for (i=8;i < 24;i++) {
+			if (w[i] != w[i & 7]) {
+				fprintf(stderr,"BUG! mirror entry %d is 0x%08X, ring has 0x%08X\n",i,w[i],w[i & 7]);
+				return 1;
+			}
+		}
+
+		mi.copies = 4;
+		if (ioctl(fd,TVBOX_I8XX_MIRROR,&mi) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_MIRROR ran past the end of the table\n");
+			return 1;
+		}
+	}
+
+	/* aperture mmap: put 64 pages of our own memory at the top of the aperture, then upload
+	 * a "frame" into them through a write-combining mapping of the aperture */
+	{
+		unsigned int x,entries = nfo.pgtable_size/sizeof(uint32_t);
+		unsigned char *raw = malloc(65 * 4096);
+		struct tvbox_i8xx_map_buffer mb;
+		struct tvbox_i8xx_register rg;
+		volatile uint32_t *ap;
+		uint32_t *src;
+		double t;
+		int h;
+
+		if (raw == NULL) return 1;
+		rg.addr = ((unsigned long)raw + 4095UL) & ~4095UL;
+		rg.size = 64 * 4096;
+		memset((void*)rg.addr,0,rg.size);
+
+		if ((h = ioctl(fd,TVBOX_I8XX_REGISTER,&rg)) <= 0) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_REGISTER, %s\n",strerror(errno));
+			return 1;
+		}
+		mb.handle = h;
+		mb.first = 0;
+		mb.count = 64;
+		mb.entry = entries - 64;
+		if (ioctl(fd,TVBOX_I8XX_MAP_BUFFER,&mb) != 64) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_MAP_BUFFER, %s\n",strerror(errno));
+			return 1;
+		}
+
+		ap = (volatile uint32_t*)mmap(NULL,64 * 4096,PROT_READ|PROT_WRITE,MAP_SHARED,fd,
+			TVBOX_I8XX_MMAP_APERTURE + ((entries - 64) * 4096));
+		if (ap == (volatile uint32_t*)MAP_FAILED) {
+			fprintf(stderr,"Cannot mmap aperture, %s\n",strerror(errno));
+			return 1;
+		}
+
+		if ((src = malloc(64 * 4096)) == NULL) return 1;
+		for (x=0;x < (64 * 1024);x++)
+			src[x] = x * 0x01010101;
+
+		t = now_ms();
+		memcpy((void*)ap,src,64 * 4096);
+		__sync_synchronize();
+		printf("256KB upload through the aperture in %.3fms\n",now_ms() - t);
+
+		for (x=0;x < (64 * 1024);x += 1021) {
+			if (ap[x] != src[x]) {
+				fprintf(stderr,"BUG! aperture word %u reads back 0x%08X\n",x,ap[x]);
+				return 1;
+			}
+		}
+
+		munmap((void*)ap,64 * 4096);
+		ioctl(fd,TVBOX_I8XX_UNREGISTER,h);
+		free(src);
+		free(raw);
+	}
+
+	/* page pool: a 1080p 32bpp frame from the pool at the top of the aperture. draw into it
+	 * through its own mapping, check it through the aperture, then free it while still mapped */
+	{
+		unsigned int x,npages,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_pool_alloc pa;
+		struct tvbox_i8xx_map_buffer mb;
+		volatile uint32_t *fb,*ap;
+		double t;
+		int h;
+
+		pa.size = (1920 * 1080 * 4 + 4095) & ~4095;
+		npages = pa.size / 4096;
+
+		t = now_ms();
+		if ((h = ioctl(fd,TVBOX_I8XX_POOL_ALLOC,&pa)) <= 0) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_POOL_ALLOC, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("1080p pool buffer allocated in %.3fms (pool_pages=%lu)\n",now_ms() - t,module_counter("pool_pages"));
+
+		mb.handle = h;
+		mb.first = 0;
+		mb.count = npages;
+		mb.entry = entries - npages;
+		if (ioctl(fd,TVBOX_I8XX_MAP_BUFFER,&mb) != (int)npages) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_MAP_BUFFER, %s\n",strerror(errno));
+			return 1;
+		}
+
+		fb = (volatile uint32_t*)mmap(NULL,pa.size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,
+			TVBOX_I8XX_MMAP_BUFFER + ((unsigned long)h * 4096));
+		ap = (volatile uint32_t*)mmap(NULL,pa.size,PROT_READ,MAP_SHARED,fd,
+			TVBOX_I8XX_MMAP_APERTURE + ((unsigned long)mb.entry * 4096));
+		if (fb == (volatile uint32_t*)MAP_FAILED || ap == (volatile uint32_t*)MAP_FAILED) {
+			fprintf(stderr,"Cannot mmap pool buffer, %s\n",strerror(errno));
+			return 1;
+		}
+
+		t = now_ms();
+		for (x=0;x < (1920 * 1080);x++)
+			fb[x] = x ^ 0x5A5A5A5A;
+		__sync_synchronize();
+		printf("1080p frame drawn into the pool buffer in %.3fms\n",now_ms() - t);
+
+		for (x=0;x < (1920 * 1080);x += 4099) {
+			if (ap[x] != (x ^ 0x5A5A5A5A)) {
+				fprintf(stderr,"BUG! pool buffer word %u reads back 0x%08X through the aperture\n",x,ap[x]);
+				return 1;
+			}
+		}
+
+		/* the pages must stay ours until munmap() */
+		if (ioctl(fd,TVBOX_I8XX_POOL_FREE,h)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_POOL_FREE, %s\n",strerror(errno));
+			return 1;
+		}
+		if (fb[1] != (1 ^ 0x5A5A5A5A)) {
+			fprintf(stderr,"BUG! pool buffer pages were taken back while still mapped\n");
+			return 1;
+		}
+		munmap((void*)ap,pa.size);
+		munmap((void*)fb,pa.size);
+
+		/* the second time around the pages are already in the pool */
+		t = now_ms();
+		if ((h = ioctl(fd,TVBOX_I8XX_POOL_ALLOC,&pa)) <= 0) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_POOL_ALLOC, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("1080p pool buffer reallocated in %.3fms\n",now_ms() - t);
+		ioctl(fd,TVBOX_I8XX_POOL_FREE,h);
+	}
+
+	/* contiguous buffer: 4MB (a 1080p 4:2:2 capture frame) mapped at the top of the aperture
+	 * in one go. the entries must be one linear run starting at the physical address */
+	{
+		unsigned int x,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_contig_alloc ca;
+		volatile uint32_t *fb;
+		uint32_t *ptes;
+		double t;
+		int h;
+
+		ca.size = 64UL << 20;
+		ca.entry = TVBOX_I8XX_NO_ENTRY;
+		if (ioctl(fd,TVBOX_I8XX_CONTIG_ALLOC,&ca) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_CONTIG_ALLOC took a block bigger than the kernel can give\n");
+			return 1;
+		}
+
+		ca.size = 4UL << 20;
+		ca.entry = entries - 1024;
+		t = now_ms();
+		if ((h = ioctl(fd,TVBOX_I8XX_CONTIG_ALLOC,&ca)) <= 0) {
+			/* fragmentation, not a bug */
+			fprintf(stderr,"Couldn't get a contiguous 4MB, %s\n",strerror(errno));
+		}
+		else {
+			printf("4MB contiguous buffer at 0x%llX allocated and mapped in %.3fms\n",ca.phys,now_ms() - t);
+
+			if ((ptes = malloc(1024 * 4)) == NULL) return 1;
+			if (pread(fd,ptes,1024 * 4,ca.entry * 4) != 1024 * 4) return 1;
+			for (x=0;x < 1024;x++) {
+				if ((ptes[x] & 0xFFFFF000UL) != (uint32_t)(ca.phys + (x * 4096)) || !(ptes[x] & 1)) {
+					fprintf(stderr,"BUG! contiguous buffer entry %u is 0x%08X\n",x,ptes[x]);
+					return 1;
+				}
+			}
+			free(ptes);
+
+			fb = (volatile uint32_t*)mmap(NULL,ca.size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,
+				TVBOX_I8XX_MMAP_BUFFER + ((unsigned long)h * 4096));
+			if (fb == (volatile uint32_t*)MAP_FAILED) {
+				fprintf(stderr,"Cannot mmap contiguous buffer, %s\n",strerror(errno));
+				return 1;
+			}
+			for (x=0;x < (1024 * 1024);x++)
+				fb[x] = x;
+			__sync_synchronize();
+			munmap((void*)fb,ca.size);
+
+			if (ioctl(fd,TVBOX_I8XX_UNREGISTER,h)) {
+				fprintf(stderr,"Failed to TVBOX_I8XX_UNREGISTER, %s\n",strerror(errno));
+				return 1;
+			}
+		}
+	}
+
+	/* stolen memory: a 64x64 cursor's worth (16KB) and a 100KB OSD plane (rounds up to 128KB),
+	 * mapped just below the top of the aperture. they must not overlap, must be linear runs
+	 * of stolen memory, and the CPU reaches them through the aperture */
+	{
+		unsigned int x,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_stolen_alloc cur,osd;
+		volatile uint32_t *ap;
+		uint32_t pte;
+		int hc,ho;
+
+		cur.size = 16384;
+		cur.entry = entries - 4;
+		osd.size = 25 * 4096;
+		osd.entry = entries - 4 - 25;
+		if ((hc = ioctl(fd,TVBOX_I8XX_STOLEN_ALLOC,&cur)) <= 0 || (ho = ioctl(fd,TVBOX_I8XX_STOLEN_ALLOC,&osd)) <= 0) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_STOLEN_ALLOC, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("stolen memory: cursor at +0x%lX, OSD at +0x%lX\n",cur.offset,osd.offset);
+		if ((cur.offset & 16383) || (osd.offset & 131071) ||
+			(cur.offset < (osd.offset + 131072) && osd.offset < (cur.offset + 16384))) {
+			fprintf(stderr,"BUG! stolen memory blocks misaligned or overlapping\n");
+			return 1;
+		}
+
+		for (x=0;x < 25;x++) {
+			if (pread(fd,&pte,4,(osd.entry + x) * 4) != 4) return 1;
+			if ((pte & 0xFFFFF000UL) != (uint32_t)(nfo.stolen_base + osd.offset + (x * 4096))) {
+				fprintf(stderr,"BUG! OSD entry %u is 0x%08X\n",x,pte);
+				return 1;
+			}
+		}
+
+		ap = (volatile uint32_t*)mmap(NULL,29 * 4096,PROT_READ|PROT_WRITE,MAP_SHARED,fd,
+			TVBOX_I8XX_MMAP_APERTURE + ((unsigned long)osd.entry * 4096));
+		if (ap == (volatile uint32_t*)MAP_FAILED) {
+			fprintf(stderr,"Cannot mmap aperture, %s\n",strerror(errno));
+			return 1;
+		}
+		for (x=0;x < (29 * 1024);x++)
+			ap[x] = ~x;
+		__sync_synchronize();
+		for (x=0;x < (29 * 1024);x += 97) {
+			if (ap[x] != ~x) {
+				fprintf(stderr,"BUG! stolen memory word %u reads back 0x%08X\n",x,ap[x]);
+				return 1;
+			}
+		}
+		munmap((void*)ap,29 * 4096);
+
+		ioctl(fd,TVBOX_I8XX_UNREGISTER,ho);
+		ioctl(fd,TVBOX_I8XX_UNREGISTER,hc);
+	}
+
+	/* hardware status page: readable through a mapping, never writable */
+	if (nfo.hwst_size != 0) {
+		volatile uint32_t *hws;
+
+		hws = (volatile uint32_t*)mmap(NULL,4096,PROT_READ|PROT_WRITE,MAP_SHARED,fd,TVBOX_I8XX_MMAP_HWS);
+		if (hws != (volatile uint32_t*)MAP_FAILED) {
+			fprintf(stderr,"BUG! the status page can be mapped writable\n");
+			return 1;
+		}
+
+		hws = (volatile uint32_t*)mmap(NULL,4096,PROT_READ,MAP_SHARED,fd,TVBOX_I8XX_MMAP_HWS);
+		if (hws == (volatile uint32_t*)MAP_FAILED) {
+			fprintf(stderr,"Cannot mmap status page, %s\n",strerror(errno));
+			return 1;
+		}
+		if (mprotect((void*)hws,4096,PROT_READ|PROT_WRITE) == 0) {
+			fprintf(stderr,"BUG! the status page can be made writable\n");
+			return 1;
+		}
+		printf("status page: ring head report 0x%08X\n",hws[4]);
+		munmap((void*)hws,4096);
+	}
+
+	/* blitter: fill a 64x64 32bpp square in a pool buffer at the top of the aperture, copy it
+	 * next to itself, and make sure the checks turn away what they should. with blt_mock
+	 * nothing is drawn, only the sequence numbers come back */
+	if (module_flag("blt_ring") || module_flag("blt_mock")) {
+		unsigned int x,entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_pool_alloc pa;
+		struct tvbox_i8xx_map_buffer mb;
+		struct tvbox_i8xx_blt bl;
+		volatile uint32_t *fb;
+		uint32_t c[14],gfx;
+		double t;
+		int h;
+
+		pa.size = 16 * 4096;
+		if ((h = ioctl(fd,TVBOX_I8XX_POOL_ALLOC,&pa)) <= 0) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_POOL_ALLOC, %s\n",strerror(errno));
+			return 1;
+		}
+		mb.handle = h;
+		mb.first = 0;
+		mb.count = 16;
+		mb.entry = entries - 16;
+		if (ioctl(fd,TVBOX_I8XX_MAP_BUFFER,&mb) != 16) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_MAP_BUFFER, %s\n",strerror(errno));
+			return 1;
+		}
+		gfx = mb.entry * 4096;
+
+		/* 128x128 surface, pitch 512 */
+		c[0] = TVBOX_I8XX_XY_COLOR_BLT | TVBOX_I8XX_XY_BLT_WRITE_RGBA;
+		c[1] = (3 << 24) | (0xF0 << 16) | 512;	/* 32bpp, PATCOPY */
+		c[2] = 0;
+		c[3] = (64 << 16) | 64;
+		c[4] = gfx;
+		c[5] = 0x12345678;
+		c[6] = TVBOX_I8XX_XY_SRC_COPY_BLT | TVBOX_I8XX_XY_BLT_WRITE_RGBA;
+		c[7] = (3 << 24) | (0xCC << 16) | 512;	/* 32bpp, SRCCOPY */
+		c[8] = 64;
+		c[9] = (64 << 16) | 128;
+		c[10] = gfx;
+		c[11] = 0;
+		c[12] = 512;
+		c[13] = gfx;
+
+		bl.cmds = c;
+		bl.count = 14;
+		t = now_ms();
+		if (ioctl(fd,TVBOX_I8XX_BLT,&bl) || ioctl(fd,TVBOX_I8XX_BLT_WAIT,bl.seqno)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_BLT, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("fill + copy blit, seqno %u, done in %.3fms\n",bl.seqno,now_ms() - t);
+
+		if (!module_flag("blt_mock")) {
+			fb = (volatile uint32_t*)mmap(NULL,pa.size,PROT_READ,MAP_SHARED,fd,
+				TVBOX_I8XX_MMAP_BUFFER + ((unsigned long)h * 4096));
+			if (fb == (volatile uint32_t*)MAP_FAILED) {
+				fprintf(stderr,"Cannot mmap pool buffer, %s\n",strerror(errno));
+				return 1;
+			}
+			for (x=0;x < 64;x++) {
+				if (fb[(x * 128) + x] != 0x12345678 || fb[(x * 128) + 64 + x] != 0x12345678) {
+					fprintf(stderr,"BUG! blit result wrong on row %u\n",x);
+					return 1;
+				}
+			}
+			munmap((void*)fb,pa.size);
+		}
+
+		/* off the end of the aperture */
+		c[4] = (entries - 1) * 4096;
+		bl.count = 6;
+		if (ioctl(fd,TVBOX_I8XX_BLT,&bl) == 0) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_BLT accepted a blit past the aperture\n");
+			return 1;
+		}
+
+		/* tiled destination, and a command that isn't a blit (MI_BATCH_BUFFER_START) */
+		c[4] = gfx;
+		c[0] |= 1 << 11;
+		if (ioctl(fd,TVBOX_I8XX_BLT,&bl) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_BLT accepted a tiled blit\n");
+			return 1;
+		}
+		c[0] = (0x31 << 23) | 1;
+		c[1] = gfx;
+		bl.count = 2;
+		if (ioctl(fd,TVBOX_I8XX_BLT,&bl) >= 0 || errno != EINVAL) {
+			fprintf(stderr,"BUG! TVBOX_I8XX_BLT let MI_BATCH_BUFFER_START through\n");
+			return 1;
+		}
+
+		ioctl(fd,TVBOX_I8XX_POOL_FREE,h);
+	}
+
+	/* snapshot test: checkpoint the table, scribble on it, put it back */
+	{
+		unsigned int entries = nfo.pgtable_size/sizeof(uint32_t);
+		struct tvbox_i8xx_snapshot sn;
+		struct tvbox_i8xx_fill f;
+		uint32_t a[64],b[64];
+		double t;
+
+		pread(fd,a,sizeof(a),(entries - 64) * 4);
+
+		memset(&sn,0,sizeof(sn));
+		t = now_ms();
+		if (ioctl(fd,TVBOX_I8XX_SNAPSHOT,&sn)) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_SNAPSHOT, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("Snapshot of %u entries: %u extents (%u bytes) in %.3fms\n",entries,sn.extents,
+			(unsigned int)(sn.extents * sizeof(struct tvbox_i8xx_extent)),now_ms() - t);
+
+		memset(&f,0,sizeof(f));
+		f.start = entries - 64;
+		f.count = 64;
+		f.base = nfo.stolen_base;
+		f.flags = 1;
+		ioctl(fd,TVBOX_I8XX_FILL,&f);
+
+		t = now_ms();
+		if (ioctl(fd,TVBOX_I8XX_SNAPSHOT_RESTORE,sn.slot) != (int)entries) {
+			fprintf(stderr,"Failed to TVBOX_I8XX_SNAPSHOT_RESTORE, %s\n",strerror(errno));
+			return 1;
+		}
+		printf("Snapshot restore in %.3fms\n",now_ms() - t);
+
+		pread(fd,b,sizeof(b),(entries - 64) * 4);
+		if (memcmp(a,b,sizeof(a))) {
+			fprintf(stderr,"BUG! snapshot restore did not bring the table back\n");
+			return 1;
+		}
+
+		if (ioctl(fd,TVBOX_I8XX_SNAPSHOT_DROP,sn.slot) || ioctl(fd,TVBOX_I8XX_SNAPSHOT_RESTORE,sn.slot) >= 0) {
+			fprintf(stderr,"BUG! snapshot still there after TVBOX_I8XX_SNAPSHOT_DROP\n");
+			return 1;
+		}
+	}
+
         if (def_pgtable(fd)) return 3;
 
-#if 0
 	printf("Going to memory-map it now...\n");
 	countdown(3);
 
 	{
-		int i;
+		unsigned int i,entries = nfo.pgtable_size/sizeof(uint32_t);
+		double t;
 		volatile uint32_t *x = (volatile uint32_t*)
-			mmap(NULL,nfo.pgtable_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,nfo.pgtable_base);
+			mmap(NULL,nfo.pgtable_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,TVBOX_I8XX_MMAP_GTT);
 		if (x == (volatile uint32_t*)(-1)) {
-			fprintf(stderr,"mmap failed\n");
+			fprintf(stderr,"mmap failed, %s\n",strerror(errno));
 			return 1;
 		}
 
 		printf("Mapped to 0x%08lX (VM)\n",(unsigned long)x);
-		for (i=0;i < nfo.pgtable_size/sizeof(uint32_t);i++) {
+		for (i=0;i < entries;i++) {
 			uint32_t word = x[i];
 			if (word != 0)
 				printf("%lu: 0x%08lX\n",
@@ -316,28 +1485,69 @@ int main() {
 		{
 			uint32_t fw = x[0];
 
-			for (i=0;i < nfo.pgtable_size/sizeof(uint32_t);i++)
-				x[i] = fw + ((i&1) * 4096);
+			for (i=0;i < entries;i++)
+				if (!drv_entry(i)) x[i] = fw + ((i&1) * 4096);
+			gtt_flush(x,entries-1);
 
 			sleep(1);
 
-			for (i=0;i < nfo.pgtable_size/sizeof(uint32_t);i++)
-				x[i] = fw + ((i&3) * 4096);
+			for (i=0;i < entries;i++)
+				if (!drv_entry(i)) x[i] = fw + ((i&3) * 4096);
+			gtt_flush(x,entries-1);
 
 			sleep(1);
 
-			for (i=0;i < nfo.pgtable_size/sizeof(uint32_t);i++)
-				x[i] = fw + ((i&7) * 4096);
+			for (i=0;i < entries;i++)
+				if (!drv_entry(i)) x[i] = fw + ((i&7) * 4096);
+			gtt_flush(x,entries-1);
 
 			sleep(1);
 
-			for (i=0;i < nfo.pgtable_size/sizeof(uint32_t);i++)
-				x[i] = fw + (i * 4096);
+			for (i=0;i < entries;i++)
+				if (!drv_entry(i)) x[i] = fw + (i * 4096);
+			gtt_flush(x,entries-1);
+
+			/* throughput: the same full-table rewrite through lseek+write, then through the mapping */
+			printf("Timing a full table rewrite (%u entries)\n",entries);
+
+			t = now_ms();
+			for (i=0;i < entries;i++) {
+				uint32_t nw = fw + (i * 4096);
+				lseek(fd,i*4,SEEK_SET);
+				if (write(fd,&nw,sizeof(nw)) != sizeof(nw)) {
+					fprintf(stderr,"Cannot write entry %u\n",i);
+					return 1;
+				}
+			}
+			printf("  lseek+write:  %.3fms\n",now_ms() - t);
+
+			t = now_ms();
+			for (i=0;i < entries;i++)
+				if (!drv_entry(i)) x[i] = fw + (i * 4096);
+			gtt_flush(x,entries-1);
+			printf("  mmap (WC):    %.3fms\n",now_ms() - t);
 		}
 
 		munmap((void*)x,nfo.pgtable_size);
+
+		/* the driver resyncs its shadow copy when the mapping goes away, so nothing should be stale */
+		{
+			int r = ioctl(fd,TVBOX_I8XX_SHADOW_SYNC);
+			if (r != 0) {
+				fprintf(stderr,"BUG! TVBOX_I8XX_SHADOW_SYNC after munmap returned %d\n",r);
+				return 1;
+			}
+		}
+	}
+
+	/* full restore, and the longest the driver went without a chance to reschedule */
+	{
+		double t = now_ms();
+		if (def_pgtable(fd)) return 3;
+		printf("Restore took %.3fms, longest chunk %luus\n",now_ms() - t,module_counter("restore_chunk_max_ns") / 1000UL);
+		printf("Driver-side full table rewrite: %luus (GTT %s)\n",module_counter("restore_last_ns") / 1000UL,
+			module_flag("gtt_wc") ? "write-combining" : "uncached");
 	}
-#endif
 
 	close(fd);
 	return 0;
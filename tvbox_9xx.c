@@ -64,6 +64,10 @@
  *             caches and queues that would delay any updates userspace
  *             is trying to do.
  *
+ *             Now maps the GTT window directly. write-combining by
+ *             default (userspace must sfence + posting read, see
+ *             tvbox_9xx.h), uncached on request.
+ *
  *           [DONE]
  *           - safe read/write to/from the page table as fallback
  *             (if we can't get mmap to work---it's slow, but it
@@ -75,37 +79,58 @@
  *             in the wrong hands, we can't let an accidental
  *             "chmod 0777" allow non-root to trash RAM.
  *
- *           [Nahhhhh...]
+ *           [DONE, sort of]
  *           - API to mass convert process virtual addresses to physical?
  *             So userspace can pass in a huge array of address and
  *             corresponding process IDs.
  *
+ *             Better: TVBOX_I8XX_BIND pins a range of the caller's
+ *             memory and writes the pages straight into the GTT.
+ *
  *           [DONE]
  *           - Optional: have a mutex to prevent more than one process
  *             from opening this device.
+ *
+ *             multi_client=1 turns that off. each client then gets
+ *             its own aperture ranges (TVBOX_I8XX_ALLOC) and may only
+ *             write there.
  */
 
+#include <linux/screen_info.h>
 #include <linux/miscdevice.h>
 #include <linux/capability.h>
+#include <linux/workqueue.h>
 /*#include <linux/semaphore.h>*/
 #include <linux/spinlock.h>
 #include <linux/vmalloc.h>
 #include <linux/pagemap.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/bitops.h>
 #include <linux/kernel.h>
 #include <linux/parser.h>
 #include <linux/mount.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/namei.h>
+#include <linux/delay.h>
 #include <linux/init.h>
+#include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/mman.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 #include <linux/pci.h>
 #include <linux/vfs.h>
+#include <linux/uio.h>
 #include <linux/mm.h>
 #include <linux/fs.h>
+#include <asm/mtrr.h>
 #include <asm/io.h>
 
 #include "tvbox_9xx.h"
+#include "tvbox_9xx_blt.h"
 
 #if defined(DEBUG_ME)
 # define DBG_(x,...) printk(KERN_INFO "tvbox_i8xx: " x "\n", __VA_ARGS__ )
@@ -118,14 +143,219 @@
 static unsigned long MB(unsigned long x) { return x << 20UL; }
 // static unsigned long KB(unsigned long x) { return x << 10UL; }
 
-/* this is a one-process-at-a-time driver, no concurrent issues that way */
+/* one process at a time, unless multi_client=1: then any number of processes may open the
+ * device, and each may only write GTT entries inside the ranges it got from TVBOX_I8XX_ALLOC.
+ * closing restores only that client's ranges instead of the whole table.
+ *
+ * locking, outermost first:
+ *   ctl_mutex   open/close bookkeeping and the whole-table operations (reset, VGA BIOS
+ *               table, shadow resync).
+ *   range_sem   read: anything that writes individual entries (write(), scatter, fill,
+ *               commit, bind, the vblank worker). entries are single 32-bit stores, so
+ *               threads working on disjoint ranges run in parallel.
+ *               write: changes to the range list, and the whole-table operations.
+ *   bind_mutex  the buffer and mapping lists.
+ *   snapshot_mutex  the snapshot list. may be taken with bind_mutex held.
+ *   pool_mutex  the page pool. may be taken with bind_mutex held.
+ *   stolen_mutex  the stolen memory allocator. may be taken with bind_mutex held.
+ *   ring_mutex  the ring tail and sequence numbers. taken with range_sem held for read.
+ * nothing touches user memory while holding range_sem. a fault there takes mmap_sem,
+ * and mmap() takes range_sem with mmap_sem held. */
 static unsigned int	is_open = 0;
-static spinlock_t	lock = SPIN_LOCK_UNLOCKED;
+static DEFINE_MUTEX(ctl_mutex);
+
+static int		multi_client = 0;
+module_param(multi_client, bool, 0444);
+MODULE_PARM_DESC(multi_client, "allow several clients, each confined to the aperture ranges it allocates");
+
+/* one per open(), in file->private_data */
+struct tvbox_i8xx_client {
+	int			staged;		/* see TVBOX_I8XX_SET_STAGED */
+	unsigned int		queue_last;	/* sequence number of our last queued batch */
+	unsigned int		queue_acked;	/* ...and the last one TVBOX_I8XX_QUEUE_STATUS reported done */
+};
 
 static size_t		pgtable_size = 0;
 /* handy way for programmer reference. pgtable_size is in bytes */
 #define pgtable_entries (pgtable_size / 4)
 
+/* cacheable copy of the GTT in system memory. every write path goes through gtt_set()
+ * so it stays in sync, and reads are served from here instead of uncached MMIO.
+ * the one thing that can go around it is a mmap() of the GTT window: while one is
+ * alive, reads go to the hardware, and the copy is resynced when the last one goes away. */
+static uint32_t*	pgtable_shadow = NULL;
+static atomic_t		gtt_mapped = ATOMIC_INIT(0);
+
+/* staged updates: while a client is staged, its write paths only touch the shadow copy
+ * and mark what changed in pgtable_dirty. TVBOX_I8XX_COMMIT pushes just those to the GTT. */
+static unsigned long*	pgtable_dirty = NULL;
+
+/* parts of the table that may differ from the default layout, one bit per DIVERGE_BLOCK entries.
+ * every write path marks (after writing), restores clear (before writing). close and unload
+ * then only have to put back what was touched */
+#define DIVERGE_SHIFT		4
+#define DIVERGE_BLOCK		(1U << DIVERGE_SHIFT)
+#define diverge_blocks		((pgtable_entries + DIVERGE_BLOCK - 1) >> DIVERGE_SHIFT)
+static unsigned long*	pgtable_diverged = NULL;
+
+/* vblank-synchronized update queue. batches queued by TVBOX_I8XX_QUEUE are applied by
+ * vblank_work during the vertical blank of vblank_pipe. we don't own the display
+ * interrupt, so the worker polls the pipe's scan line counter instead */
+struct gtt_batch {
+	struct list_head	list;
+	unsigned int		seq;
+	unsigned int		count;
+	unsigned int*		idx;
+	uint32_t*		val;
+	struct file*		owner;		/* release() flushes the queue, so this stays valid */
+};
+
+/* most entries one queued batch may carry */
+#define QUEUE_MAX_ENTRIES	4096
+
+static struct workqueue_struct*	vblank_wq = NULL;
+static struct work_struct	vblank_work;
+static LIST_HEAD(vblank_queue);
+static spinlock_t		queue_lock = SPIN_LOCK_UNLOCKED;
+static unsigned int		queue_submitted = 0;
+static unsigned int		queue_completed = 0;
+static DECLARE_WAIT_QUEUE_HEAD(queue_wait);
+
+static int		vblank_pipe = 0;
+module_param(vblank_pipe, int, 0644);
+MODULE_PARM_DESC(vblank_pipe, "display pipe (0=A 1=B) whose vertical blank paces queued updates");
+
+/* pinned user memory with its PTEs worked out ahead of time. made by TVBOX_I8XX_REGISTER
+ * (kept until unregistered) or TVBOX_I8XX_BIND (freed once nothing maps it anymore).
+ * TVBOX_I8XX_POOL_ALLOC makes the same thing out of pool pages, TVBOX_I8XX_CONTIG_ALLOC
+ * out of one physically contiguous block (no page or PTE arrays, it's all linear), and
+ * TVBOX_I8XX_STOLEN_ALLOC out of stolen memory (linear too) */
+#define BUF_USER		0
+#define BUF_POOL		1
+#define BUF_CONTIG		2
+#define BUF_STOLEN		3
+
+struct gtt_buffer {
+	struct list_head	list;
+	unsigned int		handle;		/* 0 for TVBOX_I8XX_BIND */
+	unsigned int		npages;
+	struct page**		pages;
+	uint32_t*		ptes;
+	unsigned int		maps;		/* how many gtt_mappings point at us */
+	struct file*		owner;
+	unsigned int		kind;		/* BUF_* */
+	unsigned int		vmas;		/* mmap()s of it (not BUF_USER) */
+	int			dead;		/* freed while still mmap()ed, the last munmap() finishes */
+	struct page*		block;		/* BUF_CONTIG: first page */
+	unsigned int		stolen;		/* BUF_STOLEN: first page, counted from intel_stolen_base */
+	uint32_t		pte;		/* BUF_CONTIG, BUF_STOLEN: PTE of the first page */
+};
+
+/* where buffer pages sit in the GTT. these never overlap. kept so a buffer is
+ * never unpinned while the GTT still points at it */
+struct gtt_mapping {
+	struct list_head	list;
+	unsigned int		entry;		/* first GTT entry */
+	unsigned int		count;
+	unsigned int		first;		/* first page of buf */
+	struct gtt_buffer*	buf;
+};
+
+static LIST_HEAD(buffers);
+static LIST_HEAD(mappings);
+static unsigned int	next_handle = 1;
+static DEFINE_MUTEX(bind_mutex);
+
+/* handles have to fit in an mmap() offset, see TVBOX_I8XX_MMAP_BUFFER */
+#define HANDLE_MAX		((0x80000000UL - TVBOX_I8XX_MMAP_BUFFER) >> PAGE_SHIFT)
+
+/* system memory made write-combining (or uncached) ahead of time for TVBOX_I8XX_POOL_ALLOC.
+ * changing a page's cache attribute means a page table split and a TLB shootdown, so it's
+ * done in bulk when the pool grows, and undone only when the module goes away. free pages
+ * are kept on pool_free by page->lru */
+#define POOL_ORDER		4		/* grown in blocks this big, one attribute change each */
+#define POOL_GROW		256		/* and at least this many pages at a time */
+
+static LIST_HEAD(pool_free);
+static unsigned int	pool_free_count = 0;
+static unsigned int	pool_total = 0;
+static DEFINE_MUTEX(pool_mutex);
+
+static int		pool_pages = 0;
+module_param(pool_pages, int, 0444);
+MODULE_PARM_DESC(pool_pages, "pages to put in the page pool at load time (it grows as needed)");
+
+static int		pool_uc = 0;
+module_param(pool_uc, bool, 0444);
+MODULE_PARM_DESC(pool_uc, "make page pool and contiguous buffer memory uncached instead of write-combining");
+
+/* BIOS stolen memory for TVBOX_I8XX_STOLEN_ALLOC, managed as a buddy allocator in pages
+ * counted from intel_stolen_base. only what the default layout maps is managed (so not the
+ * BIOS page table at the end), less the console framebuffer at the start and the page
+ * pgtable_vesa_bios_default() points the status page at. one element per page, the first
+ * page of a free block is on stolen_free[its order] */
+#define STOLEN_MAX_ORDER	14		/* 64MB, more than any of these chipsets steal */
+
+struct stolen_page {
+	struct list_head	list;
+	unsigned char		order;
+	unsigned char		free;
+};
+
+static struct stolen_page*	stolen_pages = NULL;
+static unsigned int		stolen_npages = 0;
+static unsigned int		stolen_free_pages = 0;
+static struct list_head		stolen_free[STOLEN_MAX_ORDER];
+static DEFINE_MUTEX(stolen_mutex);
+
+static int		stolen_reserve = -1;
+module_param(stolen_reserve, int, 0444);
+MODULE_PARM_DESC(stolen_reserve, "KB at the start of stolen memory kept for the console (-1 = what the boot framebuffer covers)");
+
+/* aperture space handed out by TVBOX_I8XX_ALLOC, sorted by entry. the stolen memory
+ * part of the default layout (what fbcon draws on) is never handed out */
+struct gtt_range {
+	struct list_head	list;
+	unsigned int		entry;
+	unsigned int		count;
+	struct file*		owner;
+};
+
+static LIST_HEAD(ranges);
+static DECLARE_RWSEM(range_sem);
+
+/* TVBOX_I8XX_SNAPSHOT: part of the table, kept as extents (see struct tvbox_i8xx_extent) */
+struct gtt_snapshot {
+	struct list_head		list;
+	unsigned int			slot;
+	unsigned int			start;
+	unsigned int			count;
+	unsigned int			nr;		/* extents in ext[] */
+	struct tvbox_i8xx_extent*	ext;
+	struct file*			owner;
+};
+
+/* most snapshots one client may hold */
+#define SNAPSHOT_MAX		16
+
+static LIST_HEAD(snapshots);
+static unsigned int	next_slot = 1;
+static DEFINE_MUTEX(snapshot_mutex);
+
+/* table restores are written this many entries at a time, with a reschedule point between
+ * chunks, so closing the device doesn't hold a CPU for milliseconds */
+#define RESTORE_CHUNK		1024
+
+/* latency check: the longest one restore chunk has taken so far */
+static unsigned long	restore_chunk_max_ns = 0;
+module_param(restore_chunk_max_ns, ulong, 0644);
+MODULE_PARM_DESC(restore_chunk_max_ns, "longest stretch (ns) a table restore ran without a reschedule point, write 0 to reset");
+
+/* debugging aid: serve every read() from the hardware and fix the shadow as we go */
+static int		shadow_verify = 0;
+module_param(shadow_verify, bool, 0644);
+MODULE_PARM_DESC(shadow_verify, "read() goes to the GTT itself and resyncs the shadow copy");
+
 /* on every Intel graphics-based laptop I own, the BIOS takes 8MB off the top of RAM (just underneath
  * the SMM area) and declares that the framebuffer. The VESA BIOS on top of that takes the last 512KB
  * of the "framebuffer" and builds a page-table there, giving VESA BIOS clients 7.5MB of video memory
@@ -146,17 +376,225 @@ static size_t		intel_smm_size = 0;
 /* Intel PCI device information */
 static size_t		aperature_size = 0;
 static size_t		aperature_base = 0;	/* first aperature only */
+static int		aperature_mtrr = -1;	/* write-combining, for TVBOX_I8XX_MMAP_APERTURE */
 static int		chipset = 0;
+static unsigned int	device_id = 0;
+
+/* our hardware status page. ordinary cached memory: the chipset snoops its writes there,
+ * so userspace can poll it (TVBOX_I8XX_MMAP_HWS) instead of reading registers. G4X takes
+ * a graphics address in HWS_PGA, so there it's also mapped at GTT entry hws_entry, right
+ * after the stolen memory part of the default layout */
+static struct page*	hws_page = NULL;
+static unsigned int	hws_entry = ~0U;
+
+/* GTT entries right after the stolen memory part of the default layout that belong to the
+ * driver: the status page (G4X), then the ring. never handed out by TVBOX_I8XX_ALLOC, and
+ * the userspace write paths leave them alone even in single-client mode */
+static unsigned int	drv_first = 0;
+static unsigned int	drv_entries = 0;
+
+/* the render ring, for TVBOX_I8XX_BLT (gen2-4 have no separate blitter ring). it lives in
+ * a contiguous write-combining block mapped at GTT entry ring_entry */
+#define PRB0_TAIL		0x2030
+#define PRB0_HEAD		0x2034
+#define PRB0_START		0x2038
+#define PRB0_CTL		0x203C
+#define RING_NR_PAGES		0x001FF000
+#define RING_VALID		0x00000001
+#define RING_HEAD_ADDR		0x001FFFFC
+#define RING_PAGES		8
+#define RING_SIZE		(RING_PAGES << PAGE_SHIFT)
+#define RING_TIMEOUT_MS		2000
+
+static struct gtt_buffer*	ring = NULL;
+static unsigned int		ring_entry = ~0U;
+static struct blt_ring		ring_buf;		/* the CPU side of it */
+static uint32_t			ring_seqno = 0;		/* last one submitted */
+static DEFINE_MUTEX(ring_mutex);
+
+static int		blt_ring = 0;
+module_param(blt_ring, bool, 0444);
+MODULE_PARM_DESC(blt_ring, "run the render ring for TVBOX_I8XX_BLT (nothing else may be using it)");
+
+/* PRB0_TAIL..PRB0_CTL when blt_mock is set */
+static uint32_t		mock_regs[4];
+static int		blt_mock = 0;
+module_param(blt_mock, bool, 0444);
+MODULE_PARM_DESC(blt_mock, "TVBOX_I8XX_BLT runs on a software model of the ring. nothing reaches the GPU, not even the GTT or HWS_PGA");
 
 /* only the first device's MMIO */
 static size_t			mmio_base = 0;
 static size_t			mmio_size = 0;
 static volatile uint32_t*	mmio = NULL;
 
+/* Intel specicially documents that half the PCI range is the MMIO, and the other half a direct window into the GTT.
+ * the GTT half is mapped on its own, write-combining, so bulk updates go out as wide bursts instead of one
+ * uncached store at a time. the register half stays uncached */
+static volatile uint32_t*	gtt = NULL;
+
+static int		gtt_wc = 1;
+module_param(gtt_wc, bool, 0444);
+MODULE_PARM_DESC(gtt_wc, "map the GTT window write-combining (0 = uncached, the old way)");
+
+/* how long the last full table restore took. compare gtt_wc=0 and gtt_wc=1 */
+static unsigned long	restore_last_ns = 0;
+module_param(restore_last_ns, ulong, 0444);
+MODULE_PARM_DESC(restore_last_ns, "time (ns) the last full table restore took");
+
 #define MMIO(x)			( *( mmio + ((x) >> 2) ) )
+#define GTT(x)			( *( gtt + (x) ) )
+
+/* physical address of that GTT window, for mmap() */
+#define gtt_phys_base		(mmio_base + (mmio_size>>1))
+
+/* make GTT updates take effect: drain the write-combining buffers, then a posting read of the last
+ * entry written. gen2-4 have no GTT TLB flush register, the read is what the chipset waits on */
+static inline void gtt_flush(unsigned int last) {
+	wmb();
+	(void)GTT(last);
+}
+
+/* [start,start+count) no longer (necessarily) holds the default layout */
+static inline void gtt_diverge(unsigned int start,unsigned int count) {
+	unsigned int b,end;
+
+	if (count == 0)
+		return;
+
+	end = (start + count - 1) >> DIVERGE_SHIFT;
+	for (b=start >> DIVERGE_SHIFT;b <= end;b++) {
+		if (!test_bit(b,pgtable_diverged))
+			set_bit(b,pgtable_diverged);
+	}
+}
+
+static uint32_t pgtable_default_pte(unsigned int idx);
+
+/* does [start,start+count) touch the driver's own entries? */
+static inline int drv_entries_hit(unsigned int start,unsigned int count) {
+	return drv_entries != 0 && start < (drv_first + drv_entries) && (start + count) > drv_first;
+}
+
+/* a run from userspace was just built over the shadow: put the driver's entries back
+ * before it goes out, so the GPU keeps fetching commands and writing status where we said */
+static inline void drv_entries_keep(unsigned int start,unsigned int count) {
+	unsigned int i;
+
+	if (!drv_entries_hit(start,count))
+		return;
+
+	for (i=max(start,drv_first);i < min(start + count,drv_first + drv_entries);i++)
+		pgtable_shadow[i] = pgtable_default_pte(i);
+}
+
+static inline void gtt_set(unsigned int idx,uint32_t val) {
+	if (drv_entries_hit(idx,1))
+		return;
+
+	pgtable_shadow[idx] = val;
+	GTT(idx) = val;
+	gtt_diverge(idx,1);
+}
+
+/* the bulk writer: PTEs for [start,start+count) are already in the shadow copy (cacheable memory),
+ * stream them out in one go. the caller ends the whole update with gtt_flush() */
+static inline void gtt_stream(unsigned int start,unsigned int count) {
+	memcpy_toio((void*)(gtt + start),pgtable_shadow + start,count * sizeof(uint32_t));
+}
+
+/* copy a run of PTEs into the shadow and stream it out */
+static inline void gtt_write_run(unsigned int start,const uint32_t *ptes,unsigned int count) {
+	memcpy(pgtable_shadow + start,ptes,count * sizeof(uint32_t));
+	drv_entries_keep(start,count);
+	gtt_stream(start,count);
+	gtt_diverge(start,count);
+}
+
+/* staged write. entries that don't actually change are not marked */
+static inline void gtt_stage(unsigned int idx,uint32_t val) {
+	if (pgtable_shadow[idx] != val && !drv_entries_hit(idx,1)) {
+		pgtable_shadow[idx] = val;
+		set_bit(idx,pgtable_dirty);
+		gtt_diverge(idx,1);
+	}
+}
+
+/* what the userspace write paths use */
+static inline void gtt_update(struct tvbox_i8xx_client *c,unsigned int idx,uint32_t val) {
+	if (c->staged)
+		gtt_stage(idx,val);
+	else
+		gtt_set(idx,val);
+}
+
+/* push staged entries in [start,start+count) out to the GTT. returns the number written */
+static unsigned int pgtable_commit(unsigned int start,unsigned int count) {
+	unsigned int i,j,k,last=0,done=0,end=start+count;
+
+	/* stream each run of dirty entries */
+	for (i=find_next_bit(pgtable_dirty,end,start);i < end;
+		i=find_next_bit(pgtable_dirty,end,j)) {
+		j = find_next_zero_bit(pgtable_dirty,end,i);
+		for (k=i;k < j;k++)
+			clear_bit(k,pgtable_dirty);
+
+		gtt_stream(i,j - i);
+		done += j - i;
+		last = j - 1;
+	}
+
+	/* one posting read for the lot */
+	if (done != 0)
+		gtt_flush(last);
+
+	return done;
+}
+
+/* reload the shadow copy from the GTT. returns the number of entries that were wrong.
+ * staged entries are supposed to differ from the hardware, and are left alone. range_sem
+ * held for writing: an entry writer running alongside could have its store undone by the
+ * stale value read back here */
+static unsigned int pgtable_shadow_sync(unsigned int start,unsigned int count) {
+	unsigned int i,bad=0,fixed=0;
+
+	for (i=start;i < (start+count);i++) {
+		uint32_t val;
+
+		if (test_bit(i,pgtable_dirty))
+			continue;
+
+		val = GTT(i);
+		if (pgtable_shadow[i] == val)
+			continue;
+
+		/* written through the GTT window. the driver's entries are ours, put them back */
+		if (drv_entries_hit(i,1)) {
+			GTT(i) = pgtable_shadow[i];
+			fixed = i + 1;
+			continue;
+		}
+
+		pgtable_shadow[i] = val;
+		gtt_diverge(i,1);
+		bad++;
+	}
 
-/* Intel specicially documents that half the PCI range is the MMIO, and the other half a direct window into the GTT */
-#define GTT(x)			MMIO(((x) << 2) + (mmio_size>>1))
+	if (fixed != 0)
+		gtt_flush(fixed - 1);
+
+	return bad;
+}
+
+/* the same, for paths that don't hold range_sem */
+static unsigned int pgtable_shadow_sync_excl(unsigned int start,unsigned int count) {
+	unsigned int bad;
+
+	down_write(&range_sem);
+	bad = pgtable_shadow_sync(start,count);
+	up_write(&range_sem);
+
+	return bad;
+}
 
 static int map_mmio(void) {
 	if (mmio_base == 0 || mmio_size == 0)
@@ -165,15 +603,34 @@ static int map_mmio(void) {
 	if (mmio != NULL) /* no leaking! */
 		return 0;
 
-	mmio = (volatile uint32_t*)ioremap(mmio_base,mmio_size);
+	/* two mappings, so the GTT half can have its own cache type. PAT won't give us
+	 * write-combining on a range that is also mapped uncached */
+	mmio = (volatile uint32_t*)ioremap_nocache(mmio_base,mmio_size>>1);
 	if (mmio == NULL)
 		return -ENODEV;
 
+	if (gtt_wc)
+		gtt = (volatile uint32_t*)ioremap_wc(gtt_phys_base,mmio_size>>1);
+	if (gtt == NULL) {
+		gtt_wc = 0;	/* mmap of TVBOX_I8XX_MMAP_GTT_UC checks this */
+		gtt = (volatile uint32_t*)ioremap_nocache(gtt_phys_base,mmio_size>>1);
+	}
+	if (gtt == NULL) {
+		iounmap((void*)mmio);
+		mmio = NULL;
+		return -ENODEV;
+	}
+
 	DBG_("mmap mmio: 0x%08lX phys 0x%08lX",(unsigned long)mmio,(unsigned long)mmio_base);
+	DBG_("mmap gtt: 0x%08lX phys 0x%08lX",(unsigned long)gtt,(unsigned long)gtt_phys_base);
 	return 0;
 }
 
 static void unmap_mmio(void) {
+	if (gtt != NULL) {
+		iounmap((void*)gtt);
+		gtt = NULL;
+	}
 	if (mmio != NULL) {
 		DBG_("unmap mmio: 0x%08lX",(unsigned long)mmio);
 		iounmap((void*)mmio);
@@ -488,11 +945,13 @@ static int find_intel_graphics(void) {
 			case 0x2E22:
 			case 0x2a42:
 				chipset = CHIP_965;
+				device_id = dev->device;
 				DBG_("  PCI slot %d, found 965 chipset",slot);
 				ret = get_965_info(bus,slot);
 				break;
 			case 0x3582:
 				chipset = CHIP_855;
+				device_id = dev->device;
 				DBG_("  PCI slot %d, found 855 chipset",slot);
 				ret = get_855_info(bus,slot);
 				break;
@@ -516,44 +975,333 @@ static void set_hws_pga(unsigned long addr) {
 	MMIO(0x2080) = addr & (~0xFFFUL);
 }
 
+/* G4X wants a graphics address in HWS_PGA, the older ones a physical address */
+static int hws_needs_gtt(void) {
+	switch (device_id) {
+		case 0x2E22:
+		case 0x2E32:
+		case 0x2A42:
+			return 1;
+	}
+
+	return 0;
+}
+
+/* the one PTE generator. see struct tvbox_i8xx_fill. caller checks the range, and
+ * flushes. a staged client only updates the shadow, otherwise the run is built in the
+ * shadow and streamed out by the bulk writer. c == NULL always writes through */
+static void gtt_fill(const struct tvbox_i8xx_fill *f,struct tvbox_i8xx_client *c) {
+	unsigned int repeat = f->repeat ? f->repeat : 1;
+	unsigned int i,rep=0,step=0;
+	uint32_t addr = f->base;
+
+	for (i=0;i < f->count;i++) {
+		if (c != NULL && c->staged)
+			gtt_stage(f->start + i,addr | f->flags);
+		else
+			pgtable_shadow[f->start + i] = addr | f->flags;
+
+		if (++rep >= repeat) {
+			rep = 0;
+			addr += f->stride;
+			if (f->period != 0 && ++step >= f->period) {
+				step = 0;
+				addr = f->base;
+			}
+		}
+	}
+
+	/* written through: the run was built in the shadow, now send it */
+	if (c == NULL || !c->staged) {
+		drv_entries_keep(f->start,f->count);
+		gtt_stream(f->start,f->count);
+		gtt_diverge(f->start,f->count);
+	}
+}
+
+/* the longest run starting at entry i and ending before 'end', read from the shadow copy.
+ * returns where the next one starts */
+static unsigned int gtt_extent(unsigned int i,unsigned int end,struct tvbox_i8xx_extent *x) {
+	uint32_t pte = pgtable_shadow[i];
+
+	x->start = i;
+	x->count = 1;
+	x->base = pte & ~0xFFFU;
+	x->flags = pte & 0xFFFU;
+	x->stride = 0;
+
+	/* the second entry decides the stride */
+	if ((i+1) < end && (pgtable_shadow[i+1] & 0xFFFU) == x->flags)
+		x->stride = (pgtable_shadow[i+1] & ~0xFFFU) - x->base;
+
+	while ((i + x->count) < end &&
+		pgtable_shadow[i + x->count] == ((x->base + (x->count * x->stride)) | x->flags))
+		x->count++;
+
+	return i + x->count;
+}
+
+/* display pipe registers */
+#define PIPE_VTOTAL(p)		(0x6000C + ((p) << 12))		/* bits 11:0 active lines-1, 27:16 total lines-1 */
+#define PIPE_DSL(p)		(0x70000 + ((p) << 12))		/* current scan line */
+#define PIPE_CONF(p)		(0x70008 + ((p) << 12))		/* bit 31 = pipe enable */
+
+/* queued batches that went out without the scan line reaching vblank in time */
+static unsigned long	vblank_timeouts = 0;
+module_param(vblank_timeouts, ulong, 0444);
+MODULE_PARM_DESC(vblank_timeouts, "queued batches applied after giving up on the vertical blank");
+
+/* wait for the pipe to enter vertical blank. no interrupt, so poll the scan line:
+ * sleep on a hrtimer for half the estimated time left (a jiffy sleep can overshoot
+ * the whole blank at HZ=100), spin for the last VBLANK_SPIN_NS. gives up after 50ms
+ * (about three frames) in case the mode is changing underneath us */
+#define VBLANK_SPIN_NS		500000UL
+#define VBLANK_NAP_NS		250000UL	/* until we know how fast the lines go by */
+
+static void wait_for_vblank(void) {
+	unsigned int p = vblank_pipe & 1;
+	unsigned long ns,left;
+	uint32_t vactive,line,line0;
+	ktime_t t0,nap;
+
+	/* only the register half of MMADR is mapped. on chipsets where that stops short of the
+	 * pipe registers (512KB MMADR) there's no scan line to poll, so apply right away */
+	if ((PIPE_CONF(p) + 4) > (mmio_size >> 1))
+		return;
+
+	/* pipe is off, nothing is scanning out */
+	if (!(MMIO(PIPE_CONF(p)) & (1UL << 31)))
+		return;
+
+	vactive = (MMIO(PIPE_VTOTAL(p)) & 0xFFF) + 1;
+	line0 = MMIO(PIPE_DSL(p)) & 0xFFF;
+	t0 = ktime_get();
+	for (;;) {
+		line = MMIO(PIPE_DSL(p)) & 0xFFF;
+		if (line >= vactive)
+			return;
+
+		ns = (unsigned long)ktime_to_ns(ktime_sub(ktime_get(),t0));
+		if (ns >= 50000000UL) {
+			vblank_timeouts++;
+			return;
+		}
+
+		/* lines left times the time per line so far (no mode has lines over 100us) */
+		if (line > line0)
+			left = (vactive - line) * min(ns / (line - line0),100000UL);
+		else
+			left = VBLANK_NAP_NS << 1;
+
+		if (left > VBLANK_SPIN_NS) {
+			nap = ktime_set(0,left >> 1);
+			set_current_state(TASK_UNINTERRUPTIBLE);
+			schedule_hrtimeout(&nap,HRTIMER_MODE_REL);
+		}
+		else {
+			cpu_relax();
+		}
+	}
+}
+
+/* apply everything queued so far in one vertical blank */
+static int client_owns(struct file *file,unsigned int start,unsigned int count);
+
+static void vblank_work_fn(struct work_struct *work) {
+	struct gtt_batch *b,*n;
+	unsigned int i,last=0,seq=0;
+	LIST_HEAD(todo);
+
+	spin_lock(&queue_lock);
+	list_splice_init(&vblank_queue,&todo);
+	spin_unlock(&queue_lock);
+
+	if (list_empty(&todo))
+		return;
+
+	wait_for_vblank();
+
+	down_read(&range_sem);
+	list_for_each_entry_safe(b,n,&todo,list) {
+		for (i=0;i < b->count;i++) {
+			/* checked when queued, but the range may have been freed (and handed to
+			 * someone else) since. those entries aren't ours to write anymore */
+			if (!client_owns(b->owner,b->idx[i],1))
+				continue;
+
+			last = b->idx[i];
+			clear_bit(last,pgtable_dirty);	/* queued write wins over anything staged */
+			gtt_set(last,b->val[i]);
+		}
+
+		seq = b->seq;
+		list_del(&b->list);
+		kfree(b);
+	}
+
+	/* one posting read for the lot */
+	gtt_flush(last);
+	up_read(&range_sem);
+
+	spin_lock(&queue_lock);
+	queue_completed = seq;
+	spin_unlock(&queue_lock);
+	wake_up_interruptible(&queue_wait);
+}
+
+/* how many entries of the default layout map stolen memory linearly. the rest repeat the last one */
+static unsigned int pgtable_default_pages(void) {
+	unsigned int def_sz = intel_stolen_size - pgtable_size;
+	return min((unsigned int)(PAGE_ALIGN(def_sz) >> PAGE_SHIFT),(unsigned int)pgtable_entries);
+}
+
+/* snooped system memory, type 11 */
+#define PTE_SNOOPED		0x6
+
+static int hws_init(void) {
+	hws_page = alloc_page(GFP_KERNEL | __GFP_DMA32 | __GFP_ZERO);
+	if (hws_page == NULL)
+		return -ENOMEM;
+
+	/* the first entry nobody else uses. pgtable_default_pte() puts it there from now on.
+	 * blt_mock keeps the page to itself, the chipset never hears of it */
+	if (hws_needs_gtt() && !blt_mock) {
+		if (pgtable_default_pages() >= pgtable_entries) {
+			DBG("no GTT entry left for the status page, leaving it where it was");
+			__free_page(hws_page);
+			hws_page = NULL;
+			return 0;
+		}
+		hws_entry = pgtable_default_pages();
+		drv_first = hws_entry;
+		drv_entries = 1;
+	}
+
+	return 0;
+}
+
+/* point the chipset at our status page (the GTT entry must be there already on G4X) */
+static void hws_program(void) {
+	if (hws_page == NULL || blt_mock)
+		return;
+
+	if (hws_needs_gtt())
+		set_hws_pga(hws_entry << PAGE_SHIFT);
+	else
+		set_hws_pga(page_to_phys(hws_page));
+}
+
+/* on the way out: the status page is about to be freed, so its GTT entry goes back to the
+ * default layout with the next restore rather than keep pointing at it */
+static void hws_forget(void) {
+	if (hws_entry == ~0U)
+		return;
+
+	gtt_diverge(hws_entry,1);
+	hws_entry = ~0U;
+}
+
+/* what pgtable_restore() puts in one entry. past the linear part it's the last page repeated,
+ * which maps out the page table itself (we know what it is, no need to read it back) */
+static uint32_t pgtable_default_pte(unsigned int idx) {
+	unsigned int def_pages = pgtable_default_pages();
+
+	if (idx == hws_entry)
+		return (uint32_t)page_to_phys(hws_page) | PTE_SNOOPED | 1;	/* __GFP_DMA32 */
+	if (ring_entry != ~0U && idx >= ring_entry && idx < (ring_entry + RING_PAGES))
+		return ring->pte + ((idx - ring_entry) << PAGE_SHIFT);
+	if (def_pages == 0)
+		return 0;
+	if (idx >= def_pages)
+		idx = def_pages - 1;
+
+	return (intel_stolen_base + (idx << PAGE_SHIFT)) | 1;
+}
+
+/* put the default layout back in [start,start+count), write-through. a 256MB aperture is
+ * 65536 uncached stores, so it's done RESTORE_CHUNK entries at a time with a chance to
+ * reschedule in between. never call this from atomic context */
+static void pgtable_restore_range(unsigned int start,unsigned int count) {
+	unsigned int i,n,end = start + count;
+	unsigned long ns;
+	ktime_t t;
+
+	/* blocks entirely inside the range are back to default. partial ones may have
+	 * touched entries outside it, so they stay marked */
+	for (i=(start + DIVERGE_BLOCK - 1) >> DIVERGE_SHIFT;i < (end >> DIVERGE_SHIFT);i++)
+		clear_bit(i,pgtable_diverged);
+
+	while (start < end) {
+		n = min(end - start,(unsigned int)RESTORE_CHUNK);
+
+		t = ktime_get();
+		for (i=start;i < (start+n);i++) {
+			clear_bit(i,pgtable_dirty);
+			pgtable_shadow[i] = pgtable_default_pte(i);
+		}
+		gtt_stream(start,n);
+
+		/* flush per chunk, so the stores are really done before we yield */
+		gtt_flush(start + n - 1);
+
+		ns = (unsigned long)ktime_to_ns(ktime_sub(ktime_get(),t));
+		if (ns > restore_chunk_max_ns)
+			restore_chunk_max_ns = ns;
+
+		start += n;
+		if (start < end)
+			cond_resched();
+	}
+}
+
 /* generate a safe pagetable that restores framebuffer sanity.
  * overwrites the contents of pgtable to do it.
  * the result lies in system RAM in a buffer we allocated,
  * but mimicks the layout used by Intel's VGA BIOS (see above for comments) */
 static void pgtable_restore(void) {
-	unsigned int page=0,addr=0;
-	unsigned int def_sz = intel_stolen_size - pgtable_size;
+	ktime_t t = ktime_get();
 
-	DBG_("making default pgtable. pgtable sz=%u",def_sz);
+	DBG_("making default pgtable. pgtable sz=%u",(unsigned int)(intel_stolen_size - pgtable_size));
 
-	while (addr < aperature_size && page < pgtable_entries && addr < def_sz) {
-		GTT(page) = (intel_stolen_base + addr) | 1;
-		addr += PAGE_SIZE;
-		page++;
-	}
+	/* linear map of stolen memory, then the page table itself mapped out by
+	 * repeating the last entry. clears every dirty bit on the way */
+	pgtable_restore_range(0,pgtable_entries);
 
-	/* map out page table itself by repeating last entry */
-	while (addr < aperature_size && page < pgtable_entries) {
-		GTT(page) = GTT(page-1);
-		addr += PAGE_SIZE;
-		page++;
-	}
+	restore_last_ns = (unsigned long)ktime_to_ns(ktime_sub(ktime_get(),t));
+}
 
-	/* fill rest with zero */
-	while (page < pgtable_entries) {
-		GTT(page) = 0;
-		page++;
+/* like pgtable_restore_range(), but only rewrites blocks that were written since
+ * they were last restored. returns the number of entries rewritten */
+static unsigned int pgtable_restore_diverged(unsigned int start,unsigned int count) {
+	unsigned int b,e,s,end = start + count,done = 0;
+
+	for (b=find_next_bit(pgtable_diverged,diverge_blocks,start >> DIVERGE_SHIFT);
+		b < diverge_blocks && (b << DIVERGE_SHIFT) < end;
+		b=find_next_bit(pgtable_diverged,diverge_blocks,e)) {
+		/* a run of marked blocks, clipped to the range */
+		e = find_next_zero_bit(pgtable_diverged,diverge_blocks,b);
+		s = max(b << DIVERGE_SHIFT,start);
+		pgtable_restore_range(s,min(e << DIVERGE_SHIFT,end) - s);
+		done += min(e << DIVERGE_SHIFT,end) - s;
 	}
+
+	return done;
 }
 
 /* pierce the veil to write into stolen memory, put a replacement table there (as if the Intel VGA BIOS has done it)
  * and then close it back up and walk away. */
 static void pgtable_vesa_bios_default(void) {
-	pgtable_restore();
-
-	/* restore h/w status register */
-	if (intel_stolen_base != 0 && intel_stolen_size != 0)
-		set_hws_pga(intel_stolen_base + (intel_stolen_size>>1));	/* <- we have to point it SOMEWHERE */
+	/* everything we or userspace ever wrote is marked, the rest is still default */
+	pgtable_restore_diverged(0,pgtable_entries);
+
+	/* restore h/w status register. on G4X that's a graphics address, and the default layout maps
+	 * that page of stolen memory at the same index */
+	if (intel_stolen_base != 0 && intel_stolen_size != 0) {
+		if (hws_needs_gtt())
+			set_hws_pga(intel_stolen_size>>1);
+		else
+			set_hws_pga(intel_stolen_base + (intel_stolen_size>>1));	/* <- we have to point it SOMEWHERE */
+	}
 
 	/* at this point the contents of our table no longer matter.
 	 * that is good---it's a safe default to fall back on so that
@@ -561,10 +1309,100 @@ static void pgtable_vesa_bios_default(void) {
 	 * may it help uvesafb's job too :) */
 }
 
-/* alignment is enforced. partial integers are dropped. we make this obvious by the byte count */
-static ssize_t tvbox_i8xx_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+/* may this file write GTT entries [start,start+count)? always, unless multi_client, then
+ * only inside ranges it allocated. the caller has already checked against the table size,
+ * and holds range_sem for as long as it relies on the answer */
+static int client_owns(struct file *file,unsigned int start,unsigned int count) {
+	unsigned int end = start + count;
+	struct gtt_range *r;
+	int ok = 0;
+
+	if (!multi_client || count == 0)
+		return 1;
+
+	/* ranges are sorted and never overlap, so walk forward through ours */
+	list_for_each_entry(r,&ranges,list) {
+		if (r->owner != file || (r->entry + r->count) <= start)
+			continue;
+		if (r->entry > start)
+			break;
+
+		start = r->entry + r->count;
+		if (start >= end) {
+			ok = 1;
+			break;
+		}
+	}
+
+	return ok;
+}
+
+/* read()/write() and their vectored versions walk the user's iovecs with one of these */
+struct iov_cursor {
+	const struct iovec*	iov;
+	unsigned long		nr;
+	size_t			off;		/* into iov[0] */
+};
+
+static int iov_copy_from(struct iov_cursor *c,void *dst,size_t n) {
+	while (n != 0) {
+		size_t k;
+
+		if (c->nr == 0)
+			return -EFAULT;
+
+		k = min(n,c->iov->iov_len - c->off);
+		if (k != 0 && copy_from_user(dst,(char __user*)c->iov->iov_base + c->off,k))
+			return -EFAULT;
+
+		dst = (char*)dst + k;
+		n -= k;
+		if ((c->off += k) == c->iov->iov_len) {
+			c->iov++;
+			c->nr--;
+			c->off = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int iov_copy_to(struct iov_cursor *c,const void *src,size_t n) {
+	while (n != 0) {
+		size_t k;
+
+		if (c->nr == 0)
+			return -EFAULT;
+
+		k = min(n,c->iov->iov_len - c->off);
+		if (k != 0 && copy_to_user((char __user*)c->iov->iov_base + c->off,src,k))
+			return -EFAULT;
+
+		src = (const char*)src + k;
+		n -= k;
+		if ((c->off += k) == c->iov->iov_len) {
+			c->iov++;
+			c->nr--;
+			c->off = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* write() pulls userspace data in this many entries at a time */
+#define WRITE_CHUNK		64
+
+/* alignment is enforced. partial integers are dropped. we make this obvious by the byte count.
+ * only *ppos is used, so threads can pwrite() disjoint parts of the table at the same time.
+ * a word may straddle two iovecs, the cursor takes care of that */
+static ssize_t tvbox_i8xx_do_write(struct file *file,struct iov_cursor *cur,size_t count,loff_t *ppos) {
+	struct tvbox_i8xx_client *c = file->private_data;
+	uint32_t tmp[WRITE_CHUNK];
 	loff_t pos = *ppos;
 	ssize_t ret = 0;
+	unsigned int i,n;
+	int ok;
 /*	DBG("write"); */
 
 	/* sanity check */
@@ -572,30 +1410,55 @@ static ssize_t tvbox_i8xx_write(struct file *file, const char __user *buf, size_
 		return -EINVAL;
 
 	pos >>= 2ULL;
-	while (count >= sizeof(uint32_t)) {
-		uint32_t word;
+	if (pos < pgtable_entries) {
+		down_read(&range_sem);
+		ok = client_owns(file,pos,min(count / sizeof(uint32_t),(size_t)(pgtable_entries - pos)));
+		up_read(&range_sem);
+		if (!ok)
+			return -EACCES;
+	}
 
-		if (pos >= pgtable_entries)
+	while (count >= sizeof(uint32_t) && pos < pgtable_entries) {
+		n = min(min(count / sizeof(uint32_t),(size_t)WRITE_CHUNK),(size_t)(pgtable_entries - pos));
+
+		if (iov_copy_from(cur,tmp,n * sizeof(uint32_t))) {
+			if (ret == 0) ret = -EFAULT;
 			break;
+		}
+
+		/* the range may have been freed since the check above */
+		down_read(&range_sem);
+		ok = client_owns(file,pos,n);
+		if (ok && c->staged) {
+			for (i=0;i < n;i++)
+				gtt_stage(pos+i,tmp[i]);
+		}
+		else if (ok) {
+			gtt_write_run(pos,tmp,n);
+		}
+		up_read(&range_sem);
 
-		if (get_user(word,(uint32_t *)buf)) {
-			ret = -EFAULT;
+		if (!ok) {
+			if (ret == 0) ret = -EACCES;
 			break;
 		}
 
-		GTT(pos++) = word;
-		count -= sizeof(uint32_t);
-		buf += sizeof(uint32_t);
-		ret += sizeof(uint32_t);
+		pos += n;
+		count -= n * sizeof(uint32_t);
+		ret += n * sizeof(uint32_t);
 	}
 
+	if (ret > 0 && !c->staged)
+		gtt_flush(pos - 1);
+
 	*ppos = pos << 2ULL;
 	return ret;
 }
 
-static ssize_t tvbox_i8xx_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+/* straight from the shadow copy into the user's buffers, no chunking needed */
+static ssize_t tvbox_i8xx_do_read(struct file *file,struct iov_cursor *cur,size_t count,loff_t *ppos) {
 	loff_t pos = *ppos;
-	ssize_t ret = 0;
+	size_t n;
 /*	DBG("read"); */
 
 	/* sanity check */
@@ -603,24 +1466,59 @@ static ssize_t tvbox_i8xx_read(struct file *file, char __user *buf, size_t count
 		return -EINVAL;
 
 	pos >>= 2ULL;
-	while (count >= sizeof(uint32_t)) {
-		uint32_t word;
+	if (pos >= pgtable_entries)
+		return 0;
 
-		if (pos >= pgtable_entries)
-			break;
+	n = min(count / sizeof(uint32_t),(size_t)(pgtable_entries - pos));
+	if (n == 0)
+		return 0;
 
-		word = GTT(pos++);
-		if (put_user(word,(uint32_t *)buf)) {
-			ret = -EFAULT;
-			break;
-		}
+	/* userspace may be writing the GTT directly through mmap, don't trust the copy then */
+	if (shadow_verify || atomic_read(&gtt_mapped) != 0)
+		pgtable_shadow_sync_excl(pos,n);
 
-		count -= sizeof(uint32_t);
-		buf += sizeof(uint32_t);
-		ret += sizeof(uint32_t);
-	}
+	if (iov_copy_to(cur,pgtable_shadow+pos,n * sizeof(uint32_t)))
+		return -EFAULT;
+
+	*ppos = (pos + n) << 2ULL;
+	return n * sizeof(uint32_t);
+}
+
+static ssize_t tvbox_i8xx_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	struct iovec iov = { .iov_base = (void __user*)buf, .iov_len = count };
+	struct iov_cursor cur = { &iov, 1, 0 };
+
+	return tvbox_i8xx_do_write(file,&cur,count,ppos);
+}
+
+static ssize_t tvbox_i8xx_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	struct iov_cursor cur = { &iov, 1, 0 };
+
+	return tvbox_i8xx_do_read(file,&cur,count,ppos);
+}
+
+/* readv()/writev()/preadv()/pwritev() and io_submit() land here. the iovecs were checked by
+ * the VFS already. everything completes before we return, there is nothing to wait for */
+static ssize_t tvbox_i8xx_aio_write(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos) {
+	struct iov_cursor cur = { iov, nr_segs, 0 };
+	ssize_t ret;
+
+	ret = tvbox_i8xx_do_write(iocb->ki_filp,&cur,iov_length(iov,nr_segs),&pos);
+	if (ret > 0)
+		iocb->ki_pos = pos;
+
+	return ret;
+}
+
+static ssize_t tvbox_i8xx_aio_read(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos) {
+	struct iov_cursor cur = { iov, nr_segs, 0 };
+	ssize_t ret;
+
+	ret = tvbox_i8xx_do_read(iocb->ki_filp,&cur,iov_length(iov,nr_segs),&pos);
+	if (ret > 0)
+		iocb->ki_pos = pos;
 
-	*ppos = pos << 2ULL;
 	return ret;
 }
 
@@ -636,86 +1534,2175 @@ static long tvbox_i8xx_ioctl_ginfo(struct tvbox_i8xx_info __user *u_nfo) {
 	i.chipset		= chipset;
 	i.pgtable_base		= 0;	/* pgtable_base_phys; */
 	i.pgtable_size		= pgtable_size;
-	i.hwst_base		= 0;	/* hwst_base_phys; */
-	i.hwst_size		= 0;	/* PAGE_SIZE; */
+	i.hwst_base		= hws_page ? (unsigned long)page_to_phys(hws_page) : 0;
+	i.hwst_size		= hws_page ? PAGE_SIZE : 0;
+	i.drv_entry		= drv_first;
+	i.drv_entries		= drv_entries;
 	return copy_to_user(u_nfo,&i,sizeof(i));
 }
 
-static long tvbox_i8xx_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
-	int ret = -EIO;
-	spin_lock(&lock);
-	DBG("ioctl");
+/* scatter requests are pulled in from userspace this many entries at a time */
+#define SCATTER_CHUNK		32
 
-	switch (cmd) {
-		case TVBOX_I8XX_GINFO:
-			ret = tvbox_i8xx_ioctl_ginfo((struct tvbox_i8xx_info __user *)arg);
-			break;
-		case TVBOX_I8XX_SET_DEFAULT_PGTABLE:
-			pgtable_restore();
-			ret = 0;
-			break;
-		case TVBOX_I8XX_SET_VGA_BIOS_PGTABLE:
-			pgtable_vesa_bios_default();
-			ret = 0;
-			break;
-		case TVBOX_I8XX_PGTABLE_ACTIVATE:
-			ret = 0;
-			break;
+static int scatter_fetch(const struct tvbox_i8xx_scatter *sc,unsigned int i,unsigned int n,unsigned int *idx,uint32_t *val) {
+	if (sc->pairs != NULL) {
+		struct tvbox_i8xx_gtt_entry tmp[SCATTER_CHUNK];
+		unsigned int j;
+
+		if (copy_from_user(tmp,sc->pairs+i,n*sizeof(*tmp)))
+			return -EFAULT;
+
+		for (j=0;j < n;j++) {
+			idx[j] = tmp[j].entry;
+			val[j] = tmp[j].pte;
+		}
+	}
+	else {
+		if (copy_from_user(idx,sc->entries+i,n*sizeof(*idx)))
+			return -EFAULT;
+		if (copy_from_user(val,sc->ptes+i,n*sizeof(*val)))
+			return -EFAULT;
 	}
 
-	spin_unlock(&lock);
-	return ret;
+	return 0;
 }
 
-static int tvbox_i8xx_open(struct inode *inode, struct file *file) {
-	/* only God may use this interface */
-	if (!capable(CAP_SYS_ADMIN))
-		return -EPERM;
+static long tvbox_i8xx_ioctl_scatter(struct file *file,struct tvbox_i8xx_scatter __user *u_sc) {
+	struct tvbox_i8xx_client *c = file->private_data;
+	struct tvbox_i8xx_scatter sc;
+	unsigned int idx[SCATTER_CHUNK];
+	uint32_t val[SCATTER_CHUNK];
+	unsigned int i,j,n,last=0;
+	long err;
+
+	if (copy_from_user(&sc,u_sc,sizeof(sc)))
+		return -EFAULT;
+	if (sc.pairs == NULL && (sc.entries == NULL || sc.ptes == NULL))
+		return -EINVAL;
 
-	spin_lock(&lock);
-	if (is_open) {
-		spin_unlock(&lock);
+	/* validate everything first, so one bad index doesn't leave the table half updated */
+	for (i=0;i < sc.count;i += n) {
+		n = min(sc.count - i,(unsigned int)SCATTER_CHUNK);
+		if (scatter_fetch(&sc,i,n,idx,val))
+			return -EFAULT;
+
+		err = 0;
+		down_read(&range_sem);
+		for (j=0;j < n && err == 0;j++) {
+			if (idx[j] >= pgtable_entries)
+				err = -EINVAL;
+			else if (!client_owns(file,idx[j],1))
+				err = -EACCES;
+		}
+		up_read(&range_sem);
+
+		if (err)
+			return err;
+	}
+
+	/* userspace could change the arrays between passes, so the check stays */
+	for (i=0;i < sc.count;i += n) {
+		n = min(sc.count - i,(unsigned int)SCATTER_CHUNK);
+		if (scatter_fetch(&sc,i,n,idx,val))
+			break;
+
+		down_read(&range_sem);
+		for (j=0;j < n && idx[j] < pgtable_entries && client_owns(file,idx[j],1);j++) {
+			last = idx[j];
+			gtt_update(c,last,val[j]);
+		}
+		up_read(&range_sem);
+
+		if (j < n) {
+			i += j;
+			break;
+		}
+	}
+
+	/* one posting read for the lot */
+	if (i != 0 && !c->staged)
+		gtt_flush(last);
+
+	return i;
+}
+
+static long tvbox_i8xx_ioctl_fill(struct file *file,struct tvbox_i8xx_fill __user *u_f) {
+	struct tvbox_i8xx_client *c = file->private_data;
+	struct tvbox_i8xx_fill f;
+
+	if (copy_from_user(&f,u_f,sizeof(f)))
+		return -EFAULT;
+	if (f.start > pgtable_entries || f.count > (pgtable_entries - f.start))
+		return -EINVAL;
+
+	down_read(&range_sem);
+	if (!client_owns(file,f.start,f.count)) {
+		up_read(&range_sem);
+		return -EACCES;
+	}
+
+	gtt_fill(&f,c);
+	if (f.count != 0 && !c->staged)
+		gtt_flush(f.start + f.count - 1);
+	up_read(&range_sem);
+
+	return f.count;
+}
+
+/* commit what this client staged. in multi-client mode, that's whatever is in its ranges */
+static unsigned int client_commit(struct file *file) {
+	struct gtt_range *r;
+	unsigned int done = 0;
+
+	down_read(&range_sem);
+	if (!multi_client) {
+		done = pgtable_commit(0,pgtable_entries);
+	}
+	else {
+		list_for_each_entry(r,&ranges,list) {
+			if (r->owner == file)
+				done += pgtable_commit(r->entry,r->count);
+		}
+	}
+	up_read(&range_sem);
+
+	return done;
+}
+
+/* put the default layout back in this client's ranges (multi-client close/reset) */
+static void client_restore(struct file *file) {
+	struct gtt_range *r;
+
+	down_read(&range_sem);
+	list_for_each_entry(r,&ranges,list) {
+		if (r->owner == file)
+			pgtable_restore_diverged(r->entry,r->count);
+	}
+	up_read(&range_sem);
+}
+
+static long tvbox_i8xx_ioctl_commit(struct file *file,struct tvbox_i8xx_commit __user *u_c) {
+	struct tvbox_i8xx_commit c;
+
+	c.entries = client_commit(file);
+
+	c.bytes = c.entries * sizeof(uint32_t);
+	if (u_c != NULL && copy_to_user(u_c,&c,sizeof(c)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* has batch 'seq' been applied? sequence numbers are 31 bits and wrap */
+static int queue_seq_done(unsigned int seq) {
+	return ((queue_completed - seq) & 0x7FFFFFFF) < 0x40000000;
+}
+
+static long tvbox_i8xx_ioctl_queue(struct file *file,struct tvbox_i8xx_scatter __user *u_sc) {
+	struct tvbox_i8xx_client *c = file->private_data;
+	struct tvbox_i8xx_scatter sc;
+	struct gtt_batch *b;
+	unsigned int i,n;
+	long err = 0;
+
+	if (copy_from_user(&sc,u_sc,sizeof(sc)))
+		return -EFAULT;
+	if (sc.pairs == NULL && (sc.entries == NULL || sc.ptes == NULL))
+		return -EINVAL;
+	if (sc.count == 0)
+		return -EINVAL;
+	if (sc.count > QUEUE_MAX_ENTRIES)
+		return -E2BIG;
+
+	b = kmalloc(sizeof(*b) + (sc.count * (sizeof(unsigned int) + sizeof(uint32_t))),GFP_KERNEL);
+	if (b == NULL)
+		return -ENOMEM;
+
+	b->count = sc.count;
+	b->owner = file;
+	b->idx = (unsigned int*)(b + 1);
+	b->val = (uint32_t*)(b->idx + sc.count);
+
+	for (i=0;i < sc.count;i += n) {
+		n = min(sc.count - i,(unsigned int)SCATTER_CHUNK);
+		if (scatter_fetch(&sc,i,n,b->idx+i,b->val+i)) {
+			kfree(b);
+			return -EFAULT;
+		}
+	}
+
+	down_read(&range_sem);
+	for (i=0;i < sc.count && err == 0;i++) {
+		if (b->idx[i] >= pgtable_entries)
+			err = -EINVAL;
+		else if (!client_owns(file,b->idx[i],1))
+			err = -EACCES;
+	}
+	up_read(&range_sem);
+
+	if (err) {
+		kfree(b);
+		return err;
+	}
+
+	spin_lock(&queue_lock);
+	b->seq = queue_submitted = (queue_submitted + 1) & 0x7FFFFFFF;
+	c->queue_last = b->seq;
+	list_add_tail(&b->list,&vblank_queue);
+	spin_unlock(&queue_lock);
+
+	queue_work(vblank_wq,&vblank_work);
+	return b->seq;
+}
+
+static long tvbox_i8xx_ioctl_queue_status(struct file *file,struct tvbox_i8xx_queue_status __user *u_qs) {
+	struct tvbox_i8xx_client *c = file->private_data;
+	struct tvbox_i8xx_queue_status qs;
+
+	spin_lock(&queue_lock);
+	qs.submitted = c->queue_last;
+	qs.completed = queue_completed;
+	if (queue_seq_done(c->queue_last))
+		c->queue_acked = c->queue_last;
+	spin_unlock(&queue_lock);
+
+	return copy_to_user(u_qs,&qs,sizeof(qs)) ? -EFAULT : 0;
+}
+
+/* page arrays can run to 64K entries, too much to ask kmalloc for */
+static void *big_alloc(size_t sz) {
+	if (sz <= PAGE_SIZE)
+		return kmalloc(sz,GFP_KERNEL);
+
+	return vmalloc(sz);
+}
+
+static void big_free(void *p) {
+	if (is_vmalloc_addr(p))
+		vfree(p);
+	else
+		kfree(p);
+}
+
+/* GTT entry for a page of system memory: valid, type 00 (system memory, not snooped).
+ * the 965 carries physical address bits 35:32 in PTE bits 7:4. returns 0 if the chipset
+ * can't reach the address */
+static uint32_t phys_to_pte(u64 phys) {
+	if (phys >> ((chipset == CHIP_965) ? 36 : 32))
+		return 0;
+
+	return ((uint32_t)phys & 0xFFFFF000UL) | ((uint32_t)(phys >> 28) & 0xF0) | 1;
+}
+
+static void unpin_pages(struct page **pages,unsigned int count) {
+	unsigned int i;
+
+	for (i=0;i < count;i++) {
+		/* the chipset may have written to it (capture) */
+		set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+
+/* add at least 'count' pages to the pool. pool_mutex held */
+static int pool_grow(unsigned int count) {
+	const gfp_t gfp = GFP_KERNEL | __GFP_DMA32 | __GFP_ZERO;
+	unsigned int i,n,order;
+	struct page *p;
+	int err;
+
+	while (count > 0) {
+		/* big blocks mean fewer attribute changes. single pages if memory is fragmented */
+		order = POOL_ORDER;
+		p = alloc_pages(gfp | __GFP_NOWARN | __GFP_NORETRY,order);
+		if (p == NULL) {
+			order = 0;
+			p = alloc_page(gfp);
+			if (p == NULL)
+				return -ENOMEM;
+		}
+
+		n = 1U << order;
+		if (pool_uc)
+			err = set_memory_uc((unsigned long)page_address(p),n);
+		else
+			err = set_memory_wc((unsigned long)page_address(p),n);
+		if (err) {
+			__free_pages(p,order);
+			return err;
+		}
+
+		/* so they can be handed out (and vm_insert_page()d) one at a time */
+		split_page(p,order);
+		for (i=0;i < n;i++)
+			list_add_tail(&(p + i)->lru,&pool_free);
+
+		pool_free_count += n;
+		pool_total += n;
+		count -= min(count,n);
+	}
+
+	return 0;
+}
+
+/* take 'count' pages out of the pool, growing it if it comes up short */
+static int pool_get(struct page **pages,unsigned int count) {
+	unsigned int i;
+	int ret = 0;
+
+	mutex_lock(&pool_mutex);
+	if (pool_free_count < count)
+		ret = pool_grow(max(count - pool_free_count,(unsigned int)POOL_GROW));
+
+	if (ret == 0) {
+		for (i=0;i < count;i++) {
+			pages[i] = list_first_entry(&pool_free,struct page,lru);
+			list_del(&pages[i]->lru);
+		}
+		pool_free_count -= count;
+	}
+	mutex_unlock(&pool_mutex);
+
+	return ret;
+}
+
+/* back into the pool, attributes untouched. wiped, so the next owner doesn't get our frames */
+static void pool_put(struct page **pages,unsigned int count) {
+	unsigned int i;
+
+	for (i=0;i < count;i++)
+		memset(page_address(pages[i]),0,PAGE_SIZE);
+
+	mutex_lock(&pool_mutex);
+	for (i=0;i < count;i++)
+		list_add(&pages[i]->lru,&pool_free);
+	pool_free_count += count;
+	mutex_unlock(&pool_mutex);
+}
+
+/* module unload, every buffer is gone and all the pages are back. the only place they're
+ * made ordinary cached memory again */
+static void pool_drain(void) {
+	struct page *p,*n;
+
+	list_for_each_entry_safe(p,n,&pool_free,lru) {
+		list_del(&p->lru);
+		set_memory_wb((unsigned long)page_address(p),1);
+		__free_page(p);
+	}
+
+	pool_free_count = 0;
+	pool_total = 0;
+}
+
+/* pin [addr,addr+size) of the caller and work out the PTEs */
+static struct gtt_buffer *gtt_buffer_pin(unsigned long addr,unsigned long size,long *err) {
+	unsigned int i,npages;
+	struct gtt_buffer *b;
+	int got;
+
+	*err = -EINVAL;
+	if ((addr | size) & ~PAGE_MASK || size == 0 || (size >> PAGE_SHIFT) > pgtable_entries)
+		return NULL;
+
+	npages = size >> PAGE_SHIFT;
+
+	*err = -ENOMEM;
+	b = kzalloc(sizeof(*b),GFP_KERNEL);
+	if (b == NULL)
+		return NULL;
+
+	b->npages = npages;
+	b->pages = big_alloc(npages * sizeof(struct page*));
+	b->ptes = big_alloc(npages * sizeof(uint32_t));
+	if (b->pages == NULL || b->ptes == NULL)
+		goto fail;
+
+	down_read(&current->mm->mmap_sem);
+	got = get_user_pages(current,current->mm,addr,npages,1,0,b->pages,NULL);
+	up_read(&current->mm->mmap_sem);
+
+	*err = -EFAULT;
+	if (got < (int)npages)
+		goto fail_unpin;
+
+	*err = -ERANGE;
+	for (i=0;i < npages;i++) {
+		b->ptes[i] = phys_to_pte(page_to_phys(b->pages[i]));
+		if (b->ptes[i] == 0)
+			goto fail_unpin;
+	}
+
+	*err = 0;
+	return b;
+
+fail_unpin:
+	if (got > 0)
+		unpin_pages(b->pages,got);
+fail:
+	if (b->ptes) big_free(b->ptes);
+	if (b->pages) big_free(b->pages);
+	kfree(b);
+	return NULL;
+}
+
+/* a buffer of pool pages. GFP_KERNEL | __GFP_DMA32 memory, so the chipset reaches all of it */
+static struct gtt_buffer *gtt_buffer_pool(unsigned long size,long *err) {
+	unsigned int i,npages;
+	struct gtt_buffer *b;
+
+	*err = -EINVAL;
+	if (size & ~PAGE_MASK || size == 0 || (size >> PAGE_SHIFT) > pgtable_entries)
+		return NULL;
+
+	npages = size >> PAGE_SHIFT;
+
+	*err = -ENOMEM;
+	b = kzalloc(sizeof(*b),GFP_KERNEL);
+	if (b == NULL)
+		return NULL;
+
+	b->npages = npages;
+	b->kind = BUF_POOL;
+	b->pages = big_alloc(npages * sizeof(struct page*));
+	b->ptes = big_alloc(npages * sizeof(uint32_t));
+	if (b->pages == NULL || b->ptes == NULL || pool_get(b->pages,npages))
+		goto fail;
+
+	for (i=0;i < npages;i++)
+		b->ptes[i] = phys_to_pte(page_to_phys(b->pages[i]));
+
+	*err = 0;
+	return b;
+
+fail:
+	if (b->ptes) big_free(b->ptes);
+	if (b->pages) big_free(b->pages);
+	kfree(b);
+	return NULL;
+}
+
+/* one physically contiguous block. the kernel's page allocator is all there is (no CMA
+ * in this kernel, and no boot time reservation from a module), so 2^(MAX_ORDER-1) pages
+ * is as big as it gets */
+static struct gtt_buffer *gtt_buffer_contig(unsigned long size,long *err) {
+	unsigned int i,npages,order;
+	struct gtt_buffer *b;
+	struct page *p;
+	int ret;
+
+	*err = -EINVAL;
+	if (size & ~PAGE_MASK || size == 0 || (size >> PAGE_SHIFT) > pgtable_entries)
+		return NULL;
+
+	order = get_order(size);
+	if (order >= MAX_ORDER)
+		return NULL;
+
+	npages = size >> PAGE_SHIFT;
+
+	*err = -ENOMEM;
+	b = kzalloc(sizeof(*b),GFP_KERNEL);
+	if (b == NULL)
+		return NULL;
+
+	p = alloc_pages(GFP_KERNEL | __GFP_DMA32 | __GFP_ZERO | __GFP_NOWARN,order);
+	if (p == NULL) {
+		kfree(b);
+		return NULL;
+	}
+
+	/* keep what was asked for, the rest of the block goes straight back */
+	split_page(p,order);
+	for (i=npages;i < (1U << order);i++)
+		__free_page(p + i);
+
+	/* same caching as the pool, one attribute change for the whole block */
+	if (pool_uc)
+		ret = set_memory_uc((unsigned long)page_address(p),npages);
+	else
+		ret = set_memory_wc((unsigned long)page_address(p),npages);
+	if (ret) {
+		for (i=0;i < npages;i++)
+			__free_page(p + i);
+		kfree(b);
+		return NULL;
+	}
+
+	b->kind = BUF_CONTIG;
+	b->npages = npages;
+	b->block = p;
+	b->pte = phys_to_pte(page_to_phys(p));
+
+	*err = 0;
+	return b;
+}
+
+/* stolen pages the console may draw on. the default layout maps entry i to stolen page i,
+ * so that's whatever part of the aperture the boot framebuffer covers */
+static unsigned int stolen_console_pages(void) {
+	unsigned long base = screen_info.lfb_base,size = screen_info.lfb_size;
+
+	if (stolen_reserve >= 0)
+		return PAGE_ALIGN((unsigned long)stolen_reserve << 10) >> PAGE_SHIFT;
+
+	/* VESA gives the size in 64KB units, EFI in bytes. text mode has no framebuffer */
+	if (screen_info.orig_video_isVGA == VIDEO_TYPE_VLFB)
+		size <<= 16;
+	else if (screen_info.orig_video_isVGA != VIDEO_TYPE_EFI)
+		return 0;
+
+	if (base < aperature_base || base >= (aperature_base + aperature_size))
+		return 0;
+
+	size = min(size,(unsigned long)(aperature_base + aperature_size - base));
+	return PAGE_ALIGN((base - aperature_base) + size) >> PAGE_SHIFT;
+}
+
+/* where pgtable_vesa_bios_default() points the status page */
+static unsigned int stolen_hws_page(void) {
+	return (intel_stolen_size >> 1) >> PAGE_SHIFT;
+}
+
+/* stolen_mutex held, or init */
+static void stolen_add(unsigned int page,unsigned int order) {
+	stolen_pages[page].order = order;
+	stolen_pages[page].free = 1;
+	list_add(&stolen_pages[page].list,&stolen_free[order]);
+	stolen_free_pages += 1U << order;
+}
+
+static int stolen_init(void) {
+	unsigned int p,o,hws = stolen_hws_page();
+
+	for (o=0;o < STOLEN_MAX_ORDER;o++)
+		INIT_LIST_HEAD(&stolen_free[o]);
+
+	stolen_npages = pgtable_default_pages();
+	if (stolen_npages == 0)
+		return 0;
+
+	stolen_pages = vmalloc(stolen_npages * sizeof(*stolen_pages));
+	if (stolen_pages == NULL)
+		return -ENOMEM;
+	memset(stolen_pages,0,stolen_npages * sizeof(*stolen_pages));
+
+	/* the biggest aligned blocks that fit, stepping over the status page */
+	for (p=stolen_console_pages();p < stolen_npages;p += 1U << o) {
+		if (p == hws) {
+			o = 0;
+			continue;
+		}
+
+		for (o=STOLEN_MAX_ORDER-1;o > 0;o--) {
+			unsigned int n = 1U << o;
+
+			if ((p & (n - 1)) == 0 && n <= (stolen_npages - p) && (hws < p || hws >= (p + n)))
+				break;
+		}
+
+		stolen_add(p,o);
+	}
+
+	DBG_("stolen memory allocator: %u of %u pages",stolen_free_pages,stolen_npages);
+	return 0;
+}
+
+/* a block of 2^order pages, or -ENOMEM */
+static long stolen_alloc(unsigned int order) {
+	struct stolen_page *sp;
+	unsigned int o,p;
+
+	mutex_lock(&stolen_mutex);
+	for (o=order;o < STOLEN_MAX_ORDER && list_empty(&stolen_free[o]);o++);
+	if (o >= STOLEN_MAX_ORDER) {
+		mutex_unlock(&stolen_mutex);
+		return -ENOMEM;
+	}
+
+	sp = list_first_entry(&stolen_free[o],struct stolen_page,list);
+	list_del(&sp->list);
+	p = sp - stolen_pages;
+	stolen_free_pages -= 1U << o;
+
+	/* give back the upper halves until it's the right size */
+	while (o > order) {
+		o--;
+		stolen_add(p + (1U << o),o);
+	}
+
+	sp->order = order;
+	sp->free = 0;
+	mutex_unlock(&stolen_mutex);
+
+	return p;
+}
+
+/* and back, merging with free buddies as far as they go */
+static void stolen_release(unsigned int page,unsigned int order) {
+	mutex_lock(&stolen_mutex);
+	while (order < (STOLEN_MAX_ORDER - 1)) {
+		unsigned int buddy = page ^ (1U << order);
+
+		if (buddy >= stolen_npages || !stolen_pages[buddy].free || stolen_pages[buddy].order != order)
+			break;
+
+		list_del(&stolen_pages[buddy].list);
+		stolen_pages[buddy].free = 0;
+		stolen_free_pages -= 1U << order;
+		page &= ~(1U << order);
+		order++;
+	}
+
+	stolen_add(page,order);
+	mutex_unlock(&stolen_mutex);
+}
+
+/* part of stolen memory. the CPU gets at it through the aperture only */
+static struct gtt_buffer *gtt_buffer_stolen(unsigned long size,long *err) {
+	struct gtt_buffer *b;
+	long page;
+
+	*err = -EINVAL;
+	if (size & ~PAGE_MASK || size == 0 || (size >> PAGE_SHIFT) > pgtable_entries)
+		return NULL;
+	if (get_order(size) >= STOLEN_MAX_ORDER)
+		return NULL;
+
+	*err = -ENOMEM;
+	b = kzalloc(sizeof(*b),GFP_KERNEL);
+	if (b == NULL)
+		return NULL;
+
+	page = stolen_alloc(get_order(size));
+	if (page < 0) {
+		kfree(b);
+		return NULL;
+	}
+
+	b->kind = BUF_STOLEN;
+	b->npages = size >> PAGE_SHIFT;
+	b->stolen = page;
+	b->pte = phys_to_pte(intel_stolen_base + ((u64)page << PAGE_SHIFT));
+
+	*err = 0;
+	return b;
+}
+
+/* unpin (pool pages go back to the pool) and free. nothing may map it anymore */
+static void gtt_buffer_free(struct gtt_buffer *b) {
+	/* still mmap()ed, tvbox_i8xx_buf_vm_close() finishes this. bind_mutex held here */
+	if (b->vmas != 0) {
+		b->dead = 1;
+		return;
+	}
+
+	if (b->kind == BUF_CONTIG) {
+		unsigned int i;
+
+		set_memory_wb((unsigned long)page_address(b->block),b->npages);
+		for (i=0;i < b->npages;i++)
+			__free_page(b->block + i);
+	}
+	else if (b->kind == BUF_STOLEN)
+		stolen_release(b->stolen,get_order(b->npages << PAGE_SHIFT));
+	else if (b->kind == BUF_POOL)
+		pool_put(b->pages,b->npages);
+	else
+		unpin_pages(b->pages,b->npages);
+	big_free(b->ptes);
+	big_free(b->pages);
+	kfree(b);
+}
+
+/* drop a mapping record. a TVBOX_I8XX_BIND buffer that loses its last one goes onto
+ * 'reap', to be freed once the caller has finished rewriting the GTT over it */
+static void gtt_mapping_drop(struct gtt_mapping *m,struct list_head *reap) {
+	struct gtt_buffer *b = m->buf;
+
+	list_del(&m->list);
+	kfree(m);
+
+	if (--b->maps == 0 && b->handle == 0)
+		list_move_tail(&b->list,reap);
+}
+
+/* [entry,entry+count) is about to be overwritten, cut it out of the mapping records.
+ * mappings never overlap, so at most one gets split in two. bind_mutex held */
+static int gtt_mappings_trim(unsigned int entry,unsigned int count,struct list_head *reap) {
+	struct gtt_mapping *m,*n,*spare;
+	unsigned int end = entry + count;
+
+	spare = kmalloc(sizeof(*spare),GFP_KERNEL);
+	if (spare == NULL)
+		return -ENOMEM;
+
+	list_for_each_entry_safe(m,n,&mappings,list) {
+		unsigned int mend = m->entry + m->count;
+
+		if (mend <= entry || m->entry >= end)
+			continue;
+
+		if (m->entry < entry && mend > end) {
+			*spare = *m;
+			spare->first = m->first + (end - m->entry);
+			spare->entry = end;
+			spare->count = mend - end;
+			list_add(&spare->list,&m->list);
+			m->buf->maps++;
+			m->count = entry - m->entry;
+			spare = NULL;
+			break;
+		}
+		else if (m->entry < entry) {
+			m->count = entry - m->entry;
+		}
+		else if (mend > end) {
+			m->first += end - m->entry;
+			m->count = mend - end;
+			m->entry = end;
+		}
+		else {
+			gtt_mapping_drop(m,reap);
+		}
+	}
+
+	kfree(spare);
+	return 0;
+}
+
+static void gtt_buffers_reap(struct list_head *reap) {
+	struct gtt_buffer *b,*n;
+
+	list_for_each_entry_safe(b,n,reap,list) {
+		list_del(&b->list);
+		gtt_buffer_free(b);
+	}
+}
+
+/* copy pages [first,first+count) of a buffer into the GTT at entry. bind_mutex held, range checked */
+static long gtt_buffer_map(struct gtt_buffer *b,unsigned int first,unsigned int count,unsigned int entry) {
+	struct gtt_mapping *m;
+	unsigned int i;
+	LIST_HEAD(reap);
+
+	/* the status page and ring stay where they are */
+	if (drv_entries_hit(entry,count))
+		return -EBUSY;
+
+	m = kmalloc(sizeof(*m),GFP_KERNEL);
+	if (m == NULL)
+		return -ENOMEM;
+
+	if (gtt_mappings_trim(entry,count,&reap)) {
+		kfree(m);
+		return -ENOMEM;
+	}
+
+	for (i=0;i < count;i++)
+		clear_bit(entry + i,pgtable_dirty);
+
+	if (b->kind == BUF_CONTIG || b->kind == BUF_STOLEN) {
+		/* one linear run, generated like the default layout */
+		struct tvbox_i8xx_fill f;
+
+		memset(&f,0,sizeof(f));
+		f.start = entry;
+		f.count = count;
+		f.base = (b->pte & 0xFFFFF000UL) + (first << PAGE_SHIFT);
+		f.stride = PAGE_SIZE;
+		f.flags = b->pte & 0xFFF;
+		gtt_fill(&f,NULL);
+	}
+	else {
+		/* precomputed, so it's a straight copy */
+		gtt_write_run(entry,b->ptes + first,count);
+	}
+	gtt_flush(entry + count - 1);
+
+	m->entry = entry;
+	m->count = count;
+	m->first = first;
+	m->buf = b;
+	b->maps++;
+	list_add_tail(&m->list,&mappings);
+
+	/* whatever was mapped here before is out of the GTT now */
+	gtt_buffers_reap(&reap);
+	return count;
+}
+
+/* take a buffer out of the GTT (default layout goes back where it was mapped), unpin it */
+static void gtt_buffer_release(struct gtt_buffer *b) {
+	struct gtt_mapping *m,*n;
+
+	list_for_each_entry_safe(m,n,&mappings,list) {
+		if (m->buf == b) {
+			pgtable_restore_range(m->entry,m->count);
+			list_del(&m->list);
+			kfree(m);
+		}
+	}
+
+	list_del(&b->list);
+	gtt_buffer_free(b);
+}
+
+static struct gtt_buffer *gtt_buffer_find(struct file *file,unsigned int handle) {
+	struct gtt_buffer *b;
+
+	list_for_each_entry(b,&buffers,list) {
+		if (b->handle == handle && b->owner == file)
+			return b;
+	}
+
+	return NULL;
+}
+
+/* next unused handle. bind_mutex held */
+static unsigned int gtt_handle_alloc(void) {
+	struct gtt_buffer *b;
+	unsigned int h,tries;
+
+	for (tries=1;tries < HANDLE_MAX;tries++) {
+		h = next_handle;
+		if (++next_handle >= HANDLE_MAX) next_handle = 1;
+
+		list_for_each_entry(b,&buffers,list) {
+			if (b->handle == h)
+				break;
+		}
+		if (&b->list == &buffers)
+			return h;
+	}
+
+	return 0;
+}
+
+static long tvbox_i8xx_ioctl_bind(struct file *file,struct tvbox_i8xx_bind __user *u_b) {
+	struct tvbox_i8xx_bind ub;
+	struct gtt_mapping *m;
+	struct gtt_buffer *b;
+	long ret;
+
+	if (copy_from_user(&ub,u_b,sizeof(ub)))
+		return -EFAULT;
+
+	b = gtt_buffer_pin(ub.addr,ub.size,&ret);
+	if (b == NULL)
+		return ret;
+
+	b->owner = file;
+	if (ub.entry > pgtable_entries || b->npages > (pgtable_entries - ub.entry)) {
+		gtt_buffer_free(b);
+		return -EINVAL;
+	}
+
+	down_read(&range_sem);
+	if (!client_owns(file,ub.entry,b->npages)) {
+		up_read(&range_sem);
+		gtt_buffer_free(b);
+		return -EACCES;
+	}
+
+	mutex_lock(&bind_mutex);
+
+	/* don't bind on top of something else, unbind first */
+	list_for_each_entry(m,&mappings,list) {
+		if (ub.entry < (m->entry + m->count) && m->entry < (ub.entry + b->npages)) {
+			mutex_unlock(&bind_mutex);
+			up_read(&range_sem);
+			gtt_buffer_free(b);
+			return -EBUSY;
+		}
+	}
+
+	list_add_tail(&b->list,&buffers);
+	ret = gtt_buffer_map(b,0,b->npages,ub.entry);
+	if (ret < 0)
+		list_del(&b->list);
+
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	if (ret < 0)
+		gtt_buffer_free(b);
+
+	return ret;
+}
+
+static long tvbox_i8xx_ioctl_unbind(struct file *file,unsigned int entry) {
+	struct gtt_mapping *m;
+	long ret = -ENOENT;
+
+	down_read(&range_sem);
+	mutex_lock(&bind_mutex);
+	list_for_each_entry(m,&mappings,list) {
+		if (m->entry == entry && m->buf->handle == 0 && m->buf->owner == file) {
+			gtt_buffer_release(m->buf);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	return ret;
+}
+
+/* give a new buffer a handle and, unless entry is TVBOX_I8XX_NO_ENTRY, map all of it there.
+ * returns the handle. on failure the buffer is freed */
+static long gtt_buffer_add(struct file *file,struct gtt_buffer *b,unsigned int entry) {
+	long ret;
+
+	b->owner = file;
+	if (entry != TVBOX_I8XX_NO_ENTRY &&
+		(entry > pgtable_entries || b->npages > (pgtable_entries - entry))) {
+		gtt_buffer_free(b);
+		return -EINVAL;
+	}
+
+	down_read(&range_sem);
+	if (entry != TVBOX_I8XX_NO_ENTRY && !client_owns(file,entry,b->npages)) {
+		up_read(&range_sem);
+		gtt_buffer_free(b);
+		return -EACCES;
+	}
+
+	mutex_lock(&bind_mutex);
+	b->handle = gtt_handle_alloc();
+	if (b->handle == 0) {
+		ret = -ENOSPC;
+	}
+	else {
+		list_add_tail(&b->list,&buffers);
+		ret = b->handle;
+		if (entry != TVBOX_I8XX_NO_ENTRY) {
+			long mapped = gtt_buffer_map(b,0,b->npages,entry);
+
+			if (mapped < 0) {
+				list_del(&b->list);
+				ret = mapped;
+			}
+		}
+	}
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	if (ret < 0)
+		gtt_buffer_free(b);
+
+	return ret;
+}
+
+static long tvbox_i8xx_ioctl_register(struct file *file,struct tvbox_i8xx_register __user *u_r) {
+	struct tvbox_i8xx_register ur;
+	struct gtt_buffer *b;
+	long ret;
+
+	if (copy_from_user(&ur,u_r,sizeof(ur)))
+		return -EFAULT;
+
+	b = gtt_buffer_pin(ur.addr,ur.size,&ret);
+	if (b == NULL)
+		return ret;
+
+	return gtt_buffer_add(file,b,TVBOX_I8XX_NO_ENTRY);
+}
+
+static long tvbox_i8xx_ioctl_pool_alloc(struct file *file,struct tvbox_i8xx_pool_alloc __user *u_p) {
+	struct tvbox_i8xx_pool_alloc up;
+	struct gtt_buffer *b;
+	long ret;
+
+	if (copy_from_user(&up,u_p,sizeof(up)))
+		return -EFAULT;
+
+	b = gtt_buffer_pool(up.size,&ret);
+	if (b == NULL)
+		return ret;
+
+	return gtt_buffer_add(file,b,TVBOX_I8XX_NO_ENTRY);
+}
+
+static long tvbox_i8xx_ioctl_contig_alloc(struct file *file,struct tvbox_i8xx_contig_alloc __user *u_c) {
+	struct tvbox_i8xx_contig_alloc uc;
+	struct gtt_buffer *b;
+	long ret;
+
+	if (copy_from_user(&uc,u_c,sizeof(uc)))
+		return -EFAULT;
+
+	b = gtt_buffer_contig(uc.size,&ret);
+	if (b == NULL)
+		return ret;
+
+	/* now, user memory can't be touched under range_sem */
+	uc.phys = page_to_phys(b->block);
+	if (copy_to_user(&u_c->phys,&uc.phys,sizeof(uc.phys))) {
+		gtt_buffer_free(b);
+		return -EFAULT;
+	}
+
+	return gtt_buffer_add(file,b,uc.entry);
+}
+
+static long tvbox_i8xx_ioctl_stolen_alloc(struct file *file,struct tvbox_i8xx_stolen_alloc __user *u_s) {
+	struct tvbox_i8xx_stolen_alloc us;
+	struct gtt_buffer *b;
+	long ret;
+
+	if (copy_from_user(&us,u_s,sizeof(us)))
+		return -EFAULT;
+
+	b = gtt_buffer_stolen(us.size,&ret);
+	if (b == NULL)
+		return ret;
+
+	us.offset = (unsigned long)b->stolen << PAGE_SHIFT;
+	if (copy_to_user(&u_s->offset,&us.offset,sizeof(us.offset))) {
+		gtt_buffer_free(b);
+		return -EFAULT;
+	}
+
+	return gtt_buffer_add(file,b,us.entry);
+}
+
+static long tvbox_i8xx_ioctl_map_buffer(struct file *file,struct tvbox_i8xx_map_buffer __user *u_m) {
+	struct tvbox_i8xx_map_buffer um;
+	struct gtt_buffer *b;
+	long ret = -ENOENT;
+
+	if (copy_from_user(&um,u_m,sizeof(um)))
+		return -EFAULT;
+	if (um.handle == 0 || um.count == 0)
+		return -EINVAL;
+	if (um.entry > pgtable_entries || um.count > (pgtable_entries - um.entry))
+		return -EINVAL;
+
+	down_read(&range_sem);
+	if (!client_owns(file,um.entry,um.count)) {
+		up_read(&range_sem);
+		return -EACCES;
+	}
+
+	mutex_lock(&bind_mutex);
+	b = gtt_buffer_find(file,um.handle);
+	if (b != NULL) {
+		if (um.first > b->npages || um.count > (b->npages - um.first))
+			ret = -EINVAL;
+		else
+			ret = gtt_buffer_map(b,um.first,um.count,um.entry);
+	}
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	return ret;
+}
+
+/* forget records made by gtt_mappings_dup() */
+static void gtt_mappings_undup(struct list_head *dup) {
+	struct gtt_mapping *m,*n;
+
+	list_for_each_entry_safe(m,n,dup,list) {
+		m->buf->maps--;
+		list_del(&m->list);
+		kfree(m);
+	}
+}
+
+/* buffer pages in [src,src+count) are about to be copied to dst: make the mapping records for the
+ * copies, in 'dup'. they go on the mappings list once dst has been trimmed. the buffers are
+ * counted as mapped right away, so trimming dst can't free one we're copying. bind_mutex held */
+static int gtt_mappings_dup(unsigned int src,unsigned int dst,unsigned int count,struct list_head *dup) {
+	struct gtt_mapping *m,*d;
+	unsigned int end = src + count;
+
+	list_for_each_entry(m,&mappings,list) {
+		unsigned int ms = max(m->entry,src);
+		unsigned int me = min(m->entry + m->count,end);
+
+		if (ms >= me)
+			continue;
+
+		d = kmalloc(sizeof(*d),GFP_KERNEL);
+		if (d == NULL) {
+			gtt_mappings_undup(dup);
+			return -ENOMEM;
+		}
+
+		d->entry = dst + (ms - src);
+		d->count = me - ms;
+		d->first = m->first + (ms - m->entry);
+		d->buf = m->buf;
+		d->buf->maps++;
+		list_add_tail(&d->list,dup);
+	}
+
+	return 0;
+}
+
+/* the guts of TVBOX_I8XX_COPY and TVBOX_I8XX_MIRROR: memmove() in the shadow, stream dst out.
+ * range_sem (read) and bind_mutex held, ranges checked, shadow up to date. the caller flushes,
+ * then reaps the buffers that were only mapped at dst */
+static long gtt_copy(unsigned int src,unsigned int dst,unsigned int count,struct list_head *reap) {
+	unsigned int i;
+	LIST_HEAD(dup);
+	long ret;
+
+	/* records first: trimming dst could cut into src if they overlap */
+	ret = gtt_mappings_dup(src,dst,count,&dup);
+	if (ret == 0 && (ret = gtt_mappings_trim(dst,count,reap)) != 0)
+		gtt_mappings_undup(&dup);
+	if (ret != 0)
+		return ret;
+
+	for (i=0;i < count;i++)
+		clear_bit(dst + i,pgtable_dirty);
+	memmove(pgtable_shadow + dst,pgtable_shadow + src,count * sizeof(uint32_t));
+	drv_entries_keep(dst,count);
+	gtt_stream(dst,count);
+	gtt_diverge(dst,count);
+
+	list_splice_tail(&dup,&mappings);
+	return 0;
+}
+
+static long tvbox_i8xx_ioctl_copy(struct file *file,struct tvbox_i8xx_copy __user *u_c) {
+	struct tvbox_i8xx_copy uc;
+	LIST_HEAD(reap);
+	long ret;
+
+	if (copy_from_user(&uc,u_c,sizeof(uc)))
+		return -EFAULT;
+	if (uc.count == 0)
+		return 0;
+	if (uc.src > pgtable_entries || uc.count > (pgtable_entries - uc.src))
+		return -EINVAL;
+	if (uc.dst > pgtable_entries || uc.count > (pgtable_entries - uc.dst))
+		return -EINVAL;
+
+	/* the shadow has the source already, unless userspace is writing the GTT through mmap */
+	if (atomic_read(&gtt_mapped) != 0)
+		pgtable_shadow_sync_excl(uc.src,uc.count);
+
+	down_read(&range_sem);
+	if (!client_owns(file,uc.src,uc.count) || !client_owns(file,uc.dst,uc.count)) {
+		up_read(&range_sem);
+		return -EACCES;
+	}
+
+	mutex_lock(&bind_mutex);
+	ret = gtt_copy(uc.src,uc.dst,uc.count,&reap);
+	if (ret == 0)
+		gtt_flush(uc.dst + uc.count - 1);
+
+	/* whatever was mapped at dst before is out of the GTT now */
+	gtt_buffers_reap(&reap);
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	return ret ? ret : uc.count;
+}
+
+static long tvbox_i8xx_ioctl_mirror(struct file *file,struct tvbox_i8xx_mirror __user *u_m) {
+	struct tvbox_i8xx_mirror um;
+	LIST_HEAD(reap);
+	unsigned int k;
+	long ret = 0;
+
+	if (copy_from_user(&um,u_m,sizeof(um)))
+		return -EFAULT;
+	if (um.copies == 0)
+		um.copies = 2;
+	if (um.count == 0 || um.copies == 1)
+		return 0;
+	if (um.entry > pgtable_entries || um.copies > ((pgtable_entries - um.entry) / um.count))
+		return -EINVAL;
+
+	if (atomic_read(&gtt_mapped) != 0)
+		pgtable_shadow_sync_excl(um.entry,um.count);
+
+	down_read(&range_sem);
+	if (!client_owns(file,um.entry,um.count * um.copies)) {
+		up_read(&range_sem);
+		return -EACCES;
+	}
+
+	mutex_lock(&bind_mutex);
+	for (k=1;k < um.copies && ret == 0;k++)
+		ret = gtt_copy(um.entry,um.entry + (k * um.count),um.count,&reap);
+	gtt_flush(um.entry + (k * um.count) - 1);
+	gtt_buffers_reap(&reap);
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	return ret ? ret : um.count * (um.copies - 1);
+}
+
+static long tvbox_i8xx_ioctl_unregister(struct file *file,unsigned int handle) {
+	struct gtt_buffer *b;
+	long ret = -ENOENT;
+
+	if (handle == 0)
+		return -EINVAL;
+
+	down_read(&range_sem);
+	mutex_lock(&bind_mutex);
+	b = gtt_buffer_find(file,handle);
+	if (b != NULL) {
+		gtt_buffer_release(b);
+		ret = 0;
+	}
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	return ret;
+}
+
+/* best fit search of the gaps between allocated ranges. range_sem held for writing.
+ * returns the entry, or -ENOSPC */
+static long gtt_range_find(unsigned int count,unsigned int align,struct list_head **after) {
+	unsigned int lo = pgtable_default_pages() + drv_entries;
+	unsigned int best_gap = ~0U;
+	long best = -ENOSPC;
+	struct gtt_range *r;
+	struct list_head *prev = &ranges;
+
+	for (;;) {
+		unsigned int hi,start;
+
+		/* the gap runs from lo up to the next range, or the end of the table */
+		if (prev->next != &ranges) {
+			r = list_entry(prev->next,struct gtt_range,list);
+			hi = r->entry;
+		}
+		else {
+			r = NULL;
+			hi = pgtable_entries;
+		}
+
+		start = (lo + align - 1) & ~(align - 1);
+		if (start < hi && count <= (hi - start) && (hi - lo) < best_gap) {
+			best_gap = hi - lo;
+			best = start;
+			*after = prev;
+		}
+
+		if (r == NULL)
+			break;
+
+		if ((r->entry + r->count) > lo)
+			lo = r->entry + r->count;
+		prev = &r->list;
+	}
+
+	return best;
+}
+
+static long tvbox_i8xx_ioctl_alloc(struct file *file,struct tvbox_i8xx_alloc __user *u_a) {
+	struct tvbox_i8xx_alloc ua;
+	struct list_head *after = NULL;
+	struct gtt_range *r;
+	long entry;
+
+	if (copy_from_user(&ua,u_a,sizeof(ua)))
+		return -EFAULT;
+	if (ua.align == 0)
+		ua.align = 1;
+	if (ua.count == 0 || ua.count > pgtable_entries || (ua.align & (ua.align - 1)))
+		return -EINVAL;
+
+	r = kmalloc(sizeof(*r),GFP_KERNEL);
+	if (r == NULL)
+		return -ENOMEM;
+
+	down_write(&range_sem);
+	entry = gtt_range_find(ua.count,ua.align,&after);
+	if (entry >= 0) {
+		r->entry = entry;
+		r->count = ua.count;
+		r->owner = file;
+		list_add(&r->list,after);
+	}
+	up_write(&range_sem);
+
+	if (entry < 0) {
+		kfree(r);
+		return entry;
+	}
+
+	ua.entry = entry;
+	if (copy_to_user(u_a,&ua,sizeof(ua))) {
+		down_write(&range_sem);
+		list_del(&r->list);
+		up_write(&range_sem);
+		kfree(r);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static uint32_t ring_reg(unsigned int reg) {
+	if (blt_mock)
+		return mock_regs[(reg - PRB0_TAIL) >> 2];
+
+	return MMIO(reg);
+}
+
+/* blt_mock: "execute" the ring from HEAD to TAIL the moment TAIL is written */
+static void mock_execute(void) {
+	unsigned int head = blt_ring_execute(&ring_buf,mock_regs[1] & RING_HEAD_ADDR,mock_regs[0] & RING_HEAD_ADDR,
+		page_address(hws_page));
+
+	mock_regs[1] = (mock_regs[1] & ~RING_HEAD_ADDR) | head;
+}
+
+static void ring_reg_set(unsigned int reg,uint32_t val) {
+	if (!blt_mock) {
+		MMIO(reg) = val;
+		return;
+	}
+
+	mock_regs[(reg - PRB0_TAIL) >> 2] = val;
+	if (reg == PRB0_TAIL && (mock_regs[3] & RING_VALID))
+		mock_execute();
+}
+
+/* has batch 'seq' been done? the counter wraps */
+static int ring_done(uint32_t seq) {
+	const volatile uint32_t *hws = page_address(hws_page);
+
+	return (int32_t)(hws[TVBOX_I8XX_HWS_SEQNO] - seq) >= 0;
+}
+
+static int ring_wait(uint32_t seq) {
+	unsigned long timeout = jiffies + msecs_to_jiffies(RING_TIMEOUT_MS);
+
+	while (!ring_done(seq)) {
+		if (time_after(jiffies,timeout))
+			return -ETIMEDOUT;
+		msleep(1);
+	}
+
+	return 0;
+}
+
+/* everything submitted so far is done. aperture space a blit may be aimed at can't be
+ * given to anyone else before that */
+static void ring_idle(void) {
+	if (ring != NULL && ring_wait(ring_seqno))
+		DBG("ring didn't go idle, GPU hung?");
+}
+
+/* the ring's GTT entries come from pgtable_default_pte(), so this goes before the
+ * first pgtable_restore(). the ring starts later, in ring_start() */
+static int ring_init(void) {
+	long err;
+
+	if (!blt_ring && !blt_mock)
+		return 0;
+
+	if (hws_page == NULL) {
+		DBG("blitter: no status page for sequence numbers");
+		return 0;
+	}
+	if (!blt_mock && (MMIO(PRB0_CTL) & RING_VALID)) {
+		DBG("blitter: somebody else runs the ring already, leaving it alone");
+		return 0;
+	}
+	if (!blt_mock && (pgtable_default_pages() + drv_entries + RING_PAGES) > pgtable_entries) {
+		DBG("blitter: no GTT entries left for the ring");
+		return 0;
+	}
+
+	ring = gtt_buffer_contig(RING_SIZE,&err);
+	if (ring == NULL)
+		return err;
+
+	ring_buf.virt = page_address(ring->block);
+	ring_buf.size = RING_SIZE;
+	ring_buf.tail = 0;
+
+	/* the mock reads the ring from here, the GPU never sees it */
+	if (blt_mock)
+		return 0;
+
+	ring_entry = pgtable_default_pages() + drv_entries;
+	drv_first = pgtable_default_pages();
+	drv_entries += RING_PAGES;
+	return 0;
+}
+
+static void ring_start(void) {
+	if (ring == NULL)
+		return;
+
+	ring_reg_set(PRB0_CTL,0);
+	ring_reg_set(PRB0_TAIL,0);
+	ring_reg_set(PRB0_HEAD,0);
+	ring_reg_set(PRB0_START,blt_mock ? 0 : ring_entry << PAGE_SHIFT);
+	ring_reg_set(PRB0_CTL,((RING_SIZE - PAGE_SIZE) & RING_NR_PAGES) | RING_VALID);
+	ring_buf.tail = 0;
+
+	DBG_("blitter: ring at GTT entry %u%s",ring_entry,blt_mock ? " (mock)" : "");
+}
+
+static void ring_stop(void) {
+	if (ring == NULL)
+		return;
+
+	ring_idle();
+	ring_reg_set(PRB0_CTL,0);
+	ring_reg_set(PRB0_HEAD,0);
+	ring_reg_set(PRB0_TAIL,0);
+	ring_reg_set(PRB0_START,0);
+}
+
+/* like hws_forget(), for the ring's entries. stopped first */
+static void ring_forget(void) {
+	if (ring_entry == ~0U)
+		return;
+
+	gtt_diverge(ring_entry,RING_PAGES);
+	ring_entry = ~0U;
+}
+
+/* room for n dwords in one run at the tail, waiting for the GPU if need be. ring_mutex held */
+static int ring_begin(unsigned int n) {
+	unsigned long timeout = jiffies + msecs_to_jiffies(RING_TIMEOUT_MS);
+
+	while (!blt_ring_room(&ring_buf,ring_reg(PRB0_HEAD) & RING_HEAD_ADDR,n)) {
+		if (time_after(jiffies,timeout))
+			return -EBUSY;
+		msleep(1);
+	}
+
+	blt_ring_wrap(&ring_buf,n);
+	return 0;
+}
+
+/* the ring is write-combining: drain it before the GPU is told */
+static void ring_advance(void) {
+	wmb();
+	ring_reg_set(PRB0_TAIL,ring_buf.tail);
+}
+
+/* blt_check() asks this about every surface. range_sem held */
+static int blt_owns(void *file,unsigned int first,unsigned int count) {
+	return client_owns(file,first,count);
+}
+
+static long tvbox_i8xx_ioctl_blt(struct file *file,struct tvbox_i8xx_blt __user *u_b) {
+	struct tvbox_i8xx_blt ub;
+	struct blt_limits l;
+	unsigned int i;
+	uint32_t *cmds;
+	long ret;
+
+	if (ring == NULL)
+		return -ENODEV;
+	if (copy_from_user(&ub,u_b,sizeof(ub)))
+		return -EFAULT;
+	if (ub.count == 0 || ub.count > BLT_MAX_DWORDS)
+		return -EINVAL;
+
+	/* in here before range_sem, and checked from here, so userspace can't change it after */
+	cmds = kmalloc(ub.count * sizeof(uint32_t),GFP_KERNEL);
+	if (cmds == NULL)
+		return -ENOMEM;
+	if (copy_from_user(cmds,ub.cmds,ub.count * sizeof(uint32_t))) {
+		kfree(cmds);
+		return -EFAULT;
+	}
+
+	/* held until it's in the ring, so the space can't be freed in between (FREE waits
+	 * for the ring to go idle after that) */
+	down_read(&range_sem);
+	l.entries = pgtable_entries;
+	l.drv_first = drv_first;
+	l.drv_entries = drv_entries;
+	l.owns = blt_owns;
+	l.ctx = file;
+	ret = blt_check(&l,cmds,ub.count);
+	if (ret == 0) {
+		mutex_lock(&ring_mutex);
+
+		/* the batch padded to a qword, then flush and store the sequence number */
+		ret = ring_begin(((ub.count + 1) & ~1U) + 4);
+		if (ret == 0) {
+			for (i=0;i < ub.count;i++)
+				blt_ring_emit(&ring_buf,cmds[i]);
+			if (ub.count & 1)
+				blt_ring_emit(&ring_buf,MI_NOOP);
+
+			blt_ring_emit(&ring_buf,MI_FLUSH);
+			blt_ring_emit(&ring_buf,MI_STORE_DWORD_INDEX);
+			blt_ring_emit(&ring_buf,TVBOX_I8XX_HWS_SEQNO << 2);
+			blt_ring_emit(&ring_buf,++ring_seqno);
+			ring_advance();
+			ub.seqno = ring_seqno;
+		}
+
+		mutex_unlock(&ring_mutex);
+	}
+	up_read(&range_sem);
+	kfree(cmds);
+
+	if (ret == 0 && copy_to_user(&u_b->seqno,&ub.seqno,sizeof(ub.seqno)))
+		return -EFAULT;
+
+	return ret;
+}
+
+/* GTT entries [first,first+count) are no longer this client's: take away any mapping of the
+ * aperture pages behind them, or of the GTT window holding them (whole pages, so a little more) */
+static void zap_user_mappings(struct file *file,unsigned int first,unsigned int count) {
+	loff_t gs = (loff_t)(first << 2) & PAGE_MASK;
+	loff_t ge = PAGE_ALIGN((loff_t)(first + count) << 2);
+
+	unmap_mapping_range(file->f_mapping,TVBOX_I8XX_MMAP_APERTURE + ((loff_t)first << PAGE_SHIFT),
+		(loff_t)count << PAGE_SHIFT,1);
+	unmap_mapping_range(file->f_mapping,TVBOX_I8XX_MMAP_GTT + gs,ge - gs,1);
+	unmap_mapping_range(file->f_mapping,TVBOX_I8XX_MMAP_GTT_UC + gs,ge - gs,1);
+}
+
+static long tvbox_i8xx_ioctl_free(struct file *file,unsigned int entry) {
+	struct gtt_range *r;
+	LIST_HEAD(reap);
+	long ret = -ENOENT;
+
+	down_write(&range_sem);
+	list_for_each_entry(r,&ranges,list) {
+		if (r->entry == entry && r->owner == file) {
+			ring_idle();
+			if (multi_client)
+				zap_user_mappings(file,r->entry,r->count);
+
+			/* buffers still mapped here would otherwise be restored over the
+			 * next owner's entries when they're unbound or released */
+			mutex_lock(&bind_mutex);
+			if (gtt_mappings_trim(r->entry,r->count,&reap)) {
+				mutex_unlock(&bind_mutex);
+				ret = -ENOMEM;
+				break;
+			}
+
+			list_del(&r->list);
+			pgtable_restore_diverged(r->entry,r->count);
+			gtt_buffers_reap(&reap);
+			mutex_unlock(&bind_mutex);
+			kfree(r);
+			ret = 0;
+			break;
+		}
+	}
+	up_write(&range_sem);
+
+	return ret;
+}
+
+static long tvbox_i8xx_ioctl_snapshot(struct file *file,struct tvbox_i8xx_snapshot __user *u_s) {
+	struct tvbox_i8xx_snapshot us;
+	struct tvbox_i8xx_extent x;
+	struct gtt_snapshot *sn,*o;
+	unsigned int i,end,nr=0,held=0;
+
+	if (copy_from_user(&us,u_s,sizeof(us)))
+		return -EFAULT;
+	if (us.start >= pgtable_entries)
+		return -EINVAL;
+	if (us.count == 0)
+		us.count = pgtable_entries - us.start;
+	if (us.count > (pgtable_entries - us.start))
+		return -EINVAL;
+
+	sn = kzalloc(sizeof(*sn),GFP_KERNEL);
+	if (sn == NULL)
+		return -ENOMEM;
+
+	/* nobody writes while we look, so both passes see the same table */
+	end = us.start + us.count;
+	down_write(&range_sem);
+	if (atomic_read(&gtt_mapped) != 0)
+		pgtable_shadow_sync(us.start,us.count);
+
+	for (i=us.start;i < end;nr++)
+		i = gtt_extent(i,end,&x);
+
+	sn->ext = big_alloc(nr * sizeof(*sn->ext));
+	if (sn->ext != NULL) {
+		for (i=us.start,nr=0;i < end;nr++)
+			i = gtt_extent(i,end,sn->ext + nr);
+	}
+	up_write(&range_sem);
+
+	if (sn->ext == NULL) {
+		kfree(sn);
+		return -ENOMEM;
+	}
+
+	sn->start = us.start;
+	sn->count = us.count;
+	sn->nr = nr;
+	sn->owner = file;
+
+	mutex_lock(&snapshot_mutex);
+	list_for_each_entry(o,&snapshots,list) {
+		if (o->owner == file)
+			held++;
+	}
+	if (held >= SNAPSHOT_MAX) {
+		mutex_unlock(&snapshot_mutex);
+		big_free(sn->ext);
+		kfree(sn);
+		return -ENOSPC;
+	}
+
+	sn->slot = next_slot;
+	next_slot = (next_slot + 1) & 0x7FFFFFFF;
+	if (next_slot == 0) next_slot = 1;
+	list_add_tail(&sn->list,&snapshots);
+	mutex_unlock(&snapshot_mutex);
+
+	us.slot = sn->slot;
+	us.extents = nr;
+	if (copy_to_user(u_s,&us,sizeof(us))) {
+		mutex_lock(&snapshot_mutex);
+		list_del(&sn->list);
+		mutex_unlock(&snapshot_mutex);
+		big_free(sn->ext);
+		kfree(sn);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/* snapshot_mutex held */
+static struct gtt_snapshot *gtt_snapshot_find(struct file *file,unsigned int slot) {
+	struct gtt_snapshot *sn;
+
+	list_for_each_entry(sn,&snapshots,list) {
+		if (sn->slot == slot && sn->owner == file)
+			return sn;
+	}
+
+	return NULL;
+}
+
+static void gtt_snapshot_free(struct gtt_snapshot *sn) {
+	list_del(&sn->list);
+	big_free(sn->ext);
+	kfree(sn);
+}
+
+/* each extent is one gtt_fill(), so the whole thing goes out through the bulk writer */
+static long tvbox_i8xx_ioctl_snapshot_restore(struct file *file,unsigned int slot) {
+	struct tvbox_i8xx_fill f;
+	struct gtt_snapshot *sn;
+	unsigned int i;
+	LIST_HEAD(reap);
+	long ret = -ENOENT;
+
+	memset(&f,0,sizeof(f));
+
+	down_read(&range_sem);
+	mutex_lock(&bind_mutex);
+	mutex_lock(&snapshot_mutex);
+	sn = gtt_snapshot_find(file,slot);
+	if (sn != NULL && !client_owns(file,sn->start,sn->count)) {
+		ret = -EACCES;
+	}
+	else if (sn != NULL && gtt_mappings_trim(sn->start,sn->count,&reap)) {
+		ret = -ENOMEM;
+	}
+	else if (sn != NULL) {
+		/* written through, whatever was staged in the range is overwritten */
+		for (i=sn->start;i < (sn->start + sn->count);i++)
+			clear_bit(i,pgtable_dirty);
+
+		for (i=0;i < sn->nr;i++) {
+			f.start = sn->ext[i].start;
+			f.count = sn->ext[i].count;
+			f.base = sn->ext[i].base;
+			f.stride = sn->ext[i].stride;
+			f.flags = sn->ext[i].flags;
+			gtt_fill(&f,NULL);
+
+			if ((i & 63) == 63)
+				cond_resched();
+		}
+
+		gtt_flush(sn->start + sn->count - 1);
+		ret = sn->count;
+	}
+	mutex_unlock(&snapshot_mutex);
+
+	/* whatever was mapped in the range before is out of the GTT now */
+	gtt_buffers_reap(&reap);
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	return ret;
+}
+
+static long tvbox_i8xx_ioctl_snapshot_drop(struct file *file,unsigned int slot) {
+	struct gtt_snapshot *sn;
+	long ret = -ENOENT;
+
+	mutex_lock(&snapshot_mutex);
+	sn = gtt_snapshot_find(file,slot);
+	if (sn != NULL) {
+		gtt_snapshot_free(sn);
+		ret = 0;
+	}
+	mutex_unlock(&snapshot_mutex);
+
+	return ret;
+}
+
+/* TVBOX_I8XX_DUMP hands extents to userspace this many at a time */
+#define DUMP_CHUNK		16
+
+static long tvbox_i8xx_ioctl_dump(struct tvbox_i8xx_dump __user *u_d) {
+	struct tvbox_i8xx_extent x[DUMP_CHUNK];
+	struct tvbox_i8xx_dump d;
+	unsigned int i,n,end,done=0;
+
+	if (copy_from_user(&d,u_d,sizeof(d)))
+		return -EFAULT;
+	if (d.start > pgtable_entries)
+		return -EINVAL;
+	if (d.count == 0)
+		d.count = pgtable_entries - d.start;
+	if (d.count > (pgtable_entries - d.start))
+		return -EINVAL;
+
+	/* same rule as read() */
+	end = d.start + d.count;
+	if (shadow_verify || atomic_read(&gtt_mapped) != 0)
+		pgtable_shadow_sync_excl(d.start,d.count);
+
+	for (i=d.start;i < end && done < d.max;done += n) {
+		for (n=0;n < DUMP_CHUNK && (done + n) < d.max && i < end;n++)
+			i = gtt_extent(i,end,x + n);
+
+		if (copy_to_user(d.extents + done,x,n * sizeof(*x)))
+			return -EFAULT;
+	}
+
+	d.next = i;
+	if (copy_to_user(&u_d->next,&d.next,sizeof(d.next)))
+		return -EFAULT;
+
+	return done;
+}
+
+static long tvbox_i8xx_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+	int ret = -EIO;
+
+	/* these lock for themselves, if they need to */
+	switch (cmd) {
+		case TVBOX_I8XX_GINFO:
+			return tvbox_i8xx_ioctl_ginfo((struct tvbox_i8xx_info __user *)arg);
+		case TVBOX_I8XX_SCATTER:
+			return tvbox_i8xx_ioctl_scatter(file,(struct tvbox_i8xx_scatter __user *)arg);
+		case TVBOX_I8XX_FILL:
+			return tvbox_i8xx_ioctl_fill(file,(struct tvbox_i8xx_fill __user *)arg);
+		case TVBOX_I8XX_COMMIT:
+			return tvbox_i8xx_ioctl_commit(file,(struct tvbox_i8xx_commit __user *)arg);
+		case TVBOX_I8XX_QUEUE:
+			return tvbox_i8xx_ioctl_queue(file,(struct tvbox_i8xx_scatter __user *)arg);
+		case TVBOX_I8XX_QUEUE_STATUS:
+			return tvbox_i8xx_ioctl_queue_status(file,(struct tvbox_i8xx_queue_status __user *)arg);
+		case TVBOX_I8XX_BIND:
+			return tvbox_i8xx_ioctl_bind(file,(struct tvbox_i8xx_bind __user *)arg);
+		case TVBOX_I8XX_UNBIND:
+			return tvbox_i8xx_ioctl_unbind(file,(unsigned int)arg);
+		case TVBOX_I8XX_REGISTER:
+			return tvbox_i8xx_ioctl_register(file,(struct tvbox_i8xx_register __user *)arg);
+		case TVBOX_I8XX_MAP_BUFFER:
+			return tvbox_i8xx_ioctl_map_buffer(file,(struct tvbox_i8xx_map_buffer __user *)arg);
+		case TVBOX_I8XX_UNREGISTER:
+			return tvbox_i8xx_ioctl_unregister(file,(unsigned int)arg);
+		case TVBOX_I8XX_ALLOC:
+			return tvbox_i8xx_ioctl_alloc(file,(struct tvbox_i8xx_alloc __user *)arg);
+		case TVBOX_I8XX_FREE:
+			return tvbox_i8xx_ioctl_free(file,(unsigned int)arg);
+		case TVBOX_I8XX_SNAPSHOT:
+			return tvbox_i8xx_ioctl_snapshot(file,(struct tvbox_i8xx_snapshot __user *)arg);
+		case TVBOX_I8XX_SNAPSHOT_RESTORE:
+			return tvbox_i8xx_ioctl_snapshot_restore(file,(unsigned int)arg);
+		case TVBOX_I8XX_SNAPSHOT_DROP:
+			return tvbox_i8xx_ioctl_snapshot_drop(file,(unsigned int)arg);
+		case TVBOX_I8XX_DUMP:
+			return tvbox_i8xx_ioctl_dump((struct tvbox_i8xx_dump __user *)arg);
+		case TVBOX_I8XX_COPY:
+			return tvbox_i8xx_ioctl_copy(file,(struct tvbox_i8xx_copy __user *)arg);
+		case TVBOX_I8XX_MIRROR:
+			return tvbox_i8xx_ioctl_mirror(file,(struct tvbox_i8xx_mirror __user *)arg);
+		case TVBOX_I8XX_POOL_ALLOC:
+			return tvbox_i8xx_ioctl_pool_alloc(file,(struct tvbox_i8xx_pool_alloc __user *)arg);
+		case TVBOX_I8XX_CONTIG_ALLOC:
+			return tvbox_i8xx_ioctl_contig_alloc(file,(struct tvbox_i8xx_contig_alloc __user *)arg);
+		case TVBOX_I8XX_STOLEN_ALLOC:
+			return tvbox_i8xx_ioctl_stolen_alloc(file,(struct tvbox_i8xx_stolen_alloc __user *)arg);
+		case TVBOX_I8XX_BLT:
+			return tvbox_i8xx_ioctl_blt(file,(struct tvbox_i8xx_blt __user *)arg);
+		case TVBOX_I8XX_BLT_WAIT:
+			return ring != NULL ? ring_wait((uint32_t)arg) : -ENODEV;
+		case TVBOX_I8XX_SET_STAGED:
+			/* leaving staged mode commits whatever is pending */
+			((struct tvbox_i8xx_client*)file->private_data)->staged = (arg != 0);
+			if (arg == 0) client_commit(file);
+			return 0;
+	}
+
+	/* with other clients around, nobody gets to reset the whole table */
+	if (multi_client) {
+		switch (cmd) {
+			case TVBOX_I8XX_SET_DEFAULT_PGTABLE:
+				client_restore(file);
+				return 0;
+			case TVBOX_I8XX_SET_VGA_BIOS_PGTABLE:
+				return -EACCES;
+		}
+	}
+
+	/* whole-table operations: one at a time, and nobody writing entries meanwhile */
+	mutex_lock(&ctl_mutex);
+	down_write(&range_sem);
+
+	switch (cmd) {
+		case TVBOX_I8XX_SET_DEFAULT_PGTABLE:
+			pgtable_restore();
+			ret = 0;
+			break;
+		case TVBOX_I8XX_SET_VGA_BIOS_PGTABLE:
+			pgtable_vesa_bios_default();
+			hws_program();	/* we're still here */
+			ret = 0;
+			break;
+		case TVBOX_I8XX_PGTABLE_ACTIVATE:
+			ret = 0;
+			break;
+		case TVBOX_I8XX_SHADOW_SYNC:
+			ret = pgtable_shadow_sync(0,pgtable_entries);
+			break;
+	}
+
+	up_write(&range_sem);
+	mutex_unlock(&ctl_mutex);
+	return ret;
+}
+
+static int tvbox_i8xx_open(struct inode *inode, struct file *file) {
+	struct tvbox_i8xx_client *c;
+
+	/* only God may use this interface */
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	c = kzalloc(sizeof(*c),GFP_KERNEL);
+	if (c == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&ctl_mutex);
+	if (is_open && !multi_client) {
+		mutex_unlock(&ctl_mutex);
+		kfree(c);
 		return -EBUSY;
 	}
 
 	is_open++;
-	spin_unlock(&lock);
+	mutex_unlock(&ctl_mutex);
+
+	file->private_data = c;
 	return 0;
 }
 
 static int tvbox_i8xx_release(struct inode *inode, struct file *file) {
-	spin_lock(&lock);
+	struct gtt_snapshot *sn,*sp;
+	struct gtt_buffer *b,*n;
+	struct gtt_range *r,*rn;
+
+	/* let anything still queued go out first, the restore below wins anyway */
+	flush_workqueue(vblank_wq);
+
+	mutex_lock(&snapshot_mutex);
+	list_for_each_entry_safe(sn,sp,&snapshots,list) {
+		if (sn->owner == file)
+			gtt_snapshot_free(sn);
+	}
+	mutex_unlock(&snapshot_mutex);
+
+	/* get bound and registered buffers out of the GTT before they're released */
+	down_read(&range_sem);
+	mutex_lock(&bind_mutex);
+	list_for_each_entry_safe(b,n,&buffers,list) {
+		if (b->owner == file)
+			gtt_buffer_release(b);
+	}
+	mutex_unlock(&bind_mutex);
+	up_read(&range_sem);
+
+	/* other clients are still using the rest of the table, only undo our part */
+	if (multi_client)
+		client_restore(file);
+
+	/* our blits may still be going into the space given back below */
+	ring_idle();
+
+	mutex_lock(&ctl_mutex);
+	down_write(&range_sem);
+
+	/* give back the aperture space this file allocated */
+	list_for_each_entry_safe(r,rn,&ranges,list) {
+		if (r->owner == file) {
+			list_del(&r->list);
+			kfree(r);
+		}
+	}
+
 	if (is_open) {
 		/* restore the page table---no questions asked.
 		 * or else, risk situations where the videomgr crashes or quit too early
 		 * and Linux fbcon is drawing on regions of the aperature mapped to
-		 * parts of System RAM that it just mapped other sensitive files into... */
-		DBG("char device is being released. restoring page tables");
-		pgtable_restore();
+		 * parts of System RAM that it just mapped other sensitive files into...
+		 * only what was written since the last restore, though (see pgtable_diverged) */
+		if (!multi_client) {
+			DBG("char device is being released. restoring page tables");
+			pgtable_restore_diverged(0,pgtable_entries);
+		}
 		/* okay we're done */
 		is_open--;
 	}
-	spin_unlock(&lock);
+
+	up_write(&range_sem);
+	mutex_unlock(&ctl_mutex);
+
+	kfree(file->private_data);
+	file->private_data = NULL;
 	return 0;
 }
 
+static void tvbox_i8xx_gtt_vm_open(struct vm_area_struct *vma) {
+	atomic_inc(&gtt_mapped);
+}
+
+static void tvbox_i8xx_gtt_vm_close(struct vm_area_struct *vma) {
+	/* last direct mapping gone, pick up whatever userspace wrote */
+	if (atomic_dec_and_test(&gtt_mapped))
+		pgtable_shadow_sync_excl(0,pgtable_entries);
+}
+
+static struct vm_operations_struct tvbox_i8xx_gtt_vm_ops = {
+	.open			= tvbox_i8xx_gtt_vm_open,
+	.close			= tvbox_i8xx_gtt_vm_close,
+};
+
+static void tvbox_i8xx_buf_vm_open(struct vm_area_struct *vma) {
+	struct gtt_buffer *b = vma->vm_private_data;
+
+	mutex_lock(&bind_mutex);
+	b->vmas++;
+	mutex_unlock(&bind_mutex);
+}
+
+static void tvbox_i8xx_buf_vm_close(struct vm_area_struct *vma) {
+	struct gtt_buffer *b = vma->vm_private_data;
+
+	/* the buffer was freed while mapped, the pages can go back to the pool now */
+	mutex_lock(&bind_mutex);
+	if (--b->vmas == 0 && b->dead)
+		gtt_buffer_free(b);
+	mutex_unlock(&bind_mutex);
+}
+
+static struct vm_operations_struct tvbox_i8xx_buf_vm_ops = {
+	.open			= tvbox_i8xx_buf_vm_open,
+	.close			= tvbox_i8xx_buf_vm_close,
+};
+
+/* TVBOX_I8XX_MMAP_BUFFER: the pages of a pool or contiguous buffer, with the pool's caching */
+static int tvbox_i8xx_mmap_buffer(struct file *file,struct vm_area_struct *vma,unsigned int handle) {
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct gtt_buffer *b;
+	unsigned int i;
+	int ret = 0;
+
+	/* a private mapping would copy-on-write into ordinary cached pages */
+	if (!(vma->vm_flags & VM_SHARED)) {
+		DBG("mmap fail, buffer mapping must be shared");
+		return -EINVAL;
+	}
+
+	mutex_lock(&bind_mutex);
+	b = gtt_buffer_find(file,handle);
+	if (b == NULL || b->kind == BUF_USER || b->kind == BUF_STOLEN || size > ((unsigned long)b->npages << PAGE_SHIFT)) {
+		mutex_unlock(&bind_mutex);
+		DBG("mmap fail, no such pool buffer");
+		return -EINVAL;
+	}
+
+	vma->vm_flags |= VM_RESERVED;
+	if (pool_uc)
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	else
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+	if (b->kind == BUF_CONTIG) {
+		/* contiguous, so one range */
+		vma->vm_flags |= VM_IO;
+		if (remap_pfn_range(vma,vma->vm_start,page_to_pfn(b->block),size,vma->vm_page_prot))
+			ret = -EAGAIN;
+	}
+	else {
+		/* on failure mmap() tears down whatever got inserted */
+		for (i=0;ret == 0 && i < (size >> PAGE_SHIFT);i++)
+			ret = vm_insert_page(vma,vma->vm_start + ((unsigned long)i << PAGE_SHIFT),b->pages[i]);
+	}
+
+	if (ret == 0) {
+		vma->vm_private_data = b;
+		vma->vm_ops = &tvbox_i8xx_buf_vm_ops;
+		b->vmas++;
+	}
+	mutex_unlock(&bind_mutex);
+
+	DBG_("mmap buffer %u: %d",handle,ret);
+	return ret;
+}
+
+/* TVBOX_I8XX_MMAP_HWS: the status page, read-only. only the chipset writes it */
+static int tvbox_i8xx_mmap_hws(struct vm_area_struct *vma,unsigned long offset,unsigned long size) {
+	if (hws_page == NULL || offset != 0 || size != PAGE_SIZE) {
+		DBG("mmap fail, the status page is one page at offset 0");
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		DBG("mmap fail, the status page is read-only");
+		return -EPERM;
+	}
+
+	/* and stays that way, no mprotect() */
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_RESERVED;
+	return vm_insert_page(vma,vma->vm_start,hws_page);
+}
+
 static int tvbox_i8xx_mmap(struct file *file,struct vm_area_struct *vma) {
-	int r=1;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long region = offset & TVBOX_I8XX_MMAP_REGION_MASK;
+	unsigned long limit,phys;
+	unsigned int first,count;
+	pgprot_t prot;
+	int ok;
 
 	DBG_("mmap vm_start=0x%08X vm_pgoff=0x%08X",(unsigned int)vma->vm_start,(unsigned int)vma->vm_pgoff);
 
-	vma->vm_flags |= VM_IO;
-	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	if (offset >= TVBOX_I8XX_MMAP_BUFFER)
+		return tvbox_i8xx_mmap_buffer(file,vma,(offset - TVBOX_I8XX_MMAP_BUFFER) >> PAGE_SHIFT);
+
+	offset &= ~TVBOX_I8XX_MMAP_REGION_MASK;
+	switch (region) {
+		case TVBOX_I8XX_MMAP_GTT:
+		case TVBOX_I8XX_MMAP_GTT_UC:
+			phys = gtt_phys_base;
+			limit = PAGE_ALIGN(min(pgtable_size,mmio_size>>1));
+			if (region == TVBOX_I8XX_MMAP_GTT) {
+				prot = pgprot_writecombine(vma->vm_page_prot);
+			}
+			else {
+				/* with PAT an uncached request on our write-combining range
+				 * quietly comes back write-combining. refuse rather than lie */
+				if (gtt_wc) {
+					DBG("mmap fail, GTT is mapped write-combining (load with gtt_wc=0)");
+					return -EBUSY;
+				}
+				prot = pgprot_noncached(vma->vm_page_prot);
+			}
+			break;
+		case TVBOX_I8XX_MMAP_APERTURE:
+			/* TVBOX_I8XX_FREE zaps these by file offset, a private mapping would lose it */
+			if (!(vma->vm_flags & VM_SHARED)) {
+				DBG("mmap fail, aperture mapping must be shared");
+				return -EINVAL;
+			}
+			phys = aperature_base;
+			limit = min(aperature_size,pgtable_entries << PAGE_SHIFT);
+			prot = pgprot_writecombine(vma->vm_page_prot);
+			break;
+		case TVBOX_I8XX_MMAP_HWS:
+			return tvbox_i8xx_mmap_hws(vma,offset,size);
+		default:
+			DBG("mmap fail, unknown region");
+			return -EINVAL;
+	}
+
+	if (offset >= limit || size > (limit - offset)) {
+		DBG("mmap fail, beyond region");
+		return -EINVAL;
+	}
+
+	/* which GTT entries the mapping lets userspace write, or write through */
+	if (region == TVBOX_I8XX_MMAP_APERTURE) {
+		first = offset >> PAGE_SHIFT;
+		count = size >> PAGE_SHIFT;
+	}
+	else {
+		first = offset >> 2;
+		count = min(size,pgtable_size - offset) >> 2;
+	}
+
+	/* a mapping writes around every check we have, so it has to cover only our entries */
+	down_read(&range_sem);
+	ok = client_owns(file,first,count);
+	up_read(&range_sem);
+	if (!ok) {
+		DBG("mmap fail, entries not owned by this client");
+		return -EACCES;
+	}
+
+	vma->vm_flags |= VM_IO | VM_RESERVED;
+	vma->vm_page_prot = prot;
 
-	if (r) {
+	if (io_remap_pfn_range(vma,vma->vm_start,(phys + offset) >> PAGE_SHIFT,size,prot)) {
 		DBG("mmap fail");
 		return -EAGAIN;
 	}
 
+	if (region != TVBOX_I8XX_MMAP_APERTURE) {
+		vma->vm_ops = &tvbox_i8xx_gtt_vm_ops;
+		tvbox_i8xx_gtt_vm_open(vma);
+
+		/* we'll never see what gets written through it, so assume all of it */
+		gtt_diverge(first,count);
+	}
+
 	DBG("mmap OK");
 	return 0;
 }
 
+/* POLLIN means this client's last queued batch completed, and TVBOX_I8XX_QUEUE_STATUS
+ * hasn't said so yet. writes never block */
+static unsigned int tvbox_i8xx_poll(struct file *file,poll_table *wait) {
+	struct tvbox_i8xx_client *c = file->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(file,&queue_wait,wait);
+
+	spin_lock(&queue_lock);
+	if (c->queue_last != c->queue_acked && queue_seq_done(c->queue_last))
+		mask |= POLLIN | POLLRDNORM;
+	spin_unlock(&queue_lock);
+
+	return mask;
+}
+
 static loff_t tvbox_i8xx_lseek(struct file *file, loff_t offset, int orig)
 {
 	loff_t size = (loff_t)pgtable_size;
@@ -748,7 +3735,10 @@ static const struct file_operations tvbox_i8xx_fops = {
 	.llseek         = tvbox_i8xx_lseek,
 	.read           = tvbox_i8xx_read,
 	.write		= tvbox_i8xx_write,
+	.aio_read	= tvbox_i8xx_aio_read,
+	.aio_write	= tvbox_i8xx_aio_write,
 	.mmap		= tvbox_i8xx_mmap,
+	.poll		= tvbox_i8xx_poll,
 	.unlocked_ioctl = tvbox_i8xx_ioctl,
 	.open           = tvbox_i8xx_open,
 	.release        = tvbox_i8xx_release,
@@ -760,6 +3750,40 @@ static struct miscdevice tvbox_i8xx_dev = {
 	.fops			= &tvbox_i8xx_fops,
 };
 
+/* tear down whatever init managed to set up */
+static void tvbox_i8xx_free(void) {
+	if (vblank_wq != NULL) {
+		destroy_workqueue(vblank_wq);
+		vblank_wq = NULL;
+	}
+
+	if (aperature_mtrr >= 0) {
+		mtrr_del(aperature_mtrr,aperature_base,aperature_size);
+		aperature_mtrr = -1;
+	}
+
+	/* stopped already, if it ever started */
+	if (ring != NULL) {
+		gtt_buffer_free(ring);
+		ring = NULL;
+	}
+
+	unmap_mmio();
+	pool_drain();
+	vfree(stolen_pages);
+	stolen_pages = NULL;
+	if (hws_page != NULL) {
+		__free_page(hws_page);
+		hws_page = NULL;
+	}
+	kfree(pgtable_diverged);
+	pgtable_diverged = NULL;
+	kfree(pgtable_dirty);
+	pgtable_dirty = NULL;
+	vfree(pgtable_shadow);
+	pgtable_shadow = NULL;
+}
+
 static int __init tvbox_i8xx_init(void) {
 	printk(KERN_INFO "Tv Box v3.0 support driver for Intel 8xx/9xx chipsets "
 		"(C) 2009 Jonathan Campbell\n");
@@ -776,9 +3800,41 @@ static int __init tvbox_i8xx_init(void) {
 		return -ENOMEM;
 	}
 
+	pgtable_shadow = vmalloc(pgtable_size);
+	pgtable_dirty = kzalloc(BITS_TO_LONGS(pgtable_entries) * sizeof(unsigned long),GFP_KERNEL);
+	pgtable_diverged = kzalloc(BITS_TO_LONGS(diverge_blocks) * sizeof(unsigned long),GFP_KERNEL);
+	vblank_wq = create_singlethread_workqueue("tvbox_i8xx");
+	if (pgtable_shadow == NULL || pgtable_dirty == NULL || pgtable_diverged == NULL || vblank_wq == NULL) {
+		tvbox_i8xx_free();
+		DBG("cannot allocate shadow pgtable");
+		return -ENOMEM;
+	}
+	INIT_WORK(&vblank_work,vblank_work_fn);
+	pgtable_shadow_sync(0,pgtable_entries);
+
+	if (stolen_init() || hws_init() || ring_init()) {
+		tvbox_i8xx_free();
+		DBG("cannot allocate stolen memory map, status page or ring");
+		return -ENOMEM;
+	}
+
+	/* not fatal, the pool grows on demand. it just won't be ready up front */
+	if (pool_pages > 0) {
+		mutex_lock(&pool_mutex);
+		if (pool_grow(pool_pages))
+			printk(KERN_WARNING "tvbox_i8xx: page pool: only got %u of %d pages\n",pool_total,pool_pages);
+		mutex_unlock(&pool_mutex);
+	}
+
+	/* for CPUs without PAT, pgprot_writecombine() alone gets us nothing. the BIOS or X may
+	 * have set this up already, in which case this fails and that's fine */
+	if (aperature_base != 0 && aperature_size != 0)
+		aperature_mtrr = mtrr_add(aperature_base,aperature_size,MTRR_TYPE_WRCOMB,1);
+	DBG_("aperature MTRR = %d",aperature_mtrr);
+
 	DBG_("Registering char dev misc, minor %d",TVBOX_I8XX_MINOR);
 	if (misc_register(&tvbox_i8xx_dev)) {
-		unmap_mmio();
+		tvbox_i8xx_free();
 		DBG("Misc register failed!");
 		return -ENODEV;
 	}
@@ -789,23 +3845,31 @@ static int __init tvbox_i8xx_init(void) {
 		DBG_("Intel PGTBL_CTL = 0x%08lX",(unsigned long)pg);
 		DBG_("Intel HWS_PGA = 0x%08lX",(unsigned long)hw);
 	}
+	if ((PIPE_CONF(1) + 4) > (mmio_size >> 1))
+		DBG("pipe registers aren't mapped, queued batches won't wait for vblank");
 
 	DBG("Redirecting screen to my local pagetable, away from VESA BIOS");
 	pgtable_restore();
+	hws_program();
+	ring_start();
 
 	return 0; /* OK */
 }
 
 static void __exit tvbox_i8xx_cleanup(void) {
 	if (mmio != NULL) {
+		/* the idle wait reads sequence numbers from our status page, so before HWS_PGA moves */
+		ring_stop();
 		DBG("Restoring framebuffer and pagetable");
+		ring_forget();
+		hws_forget();
 		pgtable_vesa_bios_default();
 	}
 
 	DBG("Unregistering device");
 	misc_deregister(&tvbox_i8xx_dev);
 	DBG("Unmapping MMIO");
-	unmap_mmio();
+	tvbox_i8xx_free();
 	DBG("Goodbye");
 }
 
@@ -41,9 +41,15 @@ struct tvbox_i8xx_info {
 	unsigned long		pgtable_base;
 	unsigned long		pgtable_size;
 
-/* hardware status page */
+/* hardware status page (physical address; mmap() it at TVBOX_I8XX_MMAP_HWS) */
 	unsigned long		hwst_base;
 	unsigned long		hwst_size;
+
+/* GTT entries the driver keeps for the status page and ring. writes to them through the
+ * driver are dropped (BIND and MAP_BUFFER fail with EBUSY), and what the GTT window
+ * mmap wrote there is put back on the next shadow resync */
+	unsigned int		drv_entry;
+	unsigned int		drv_entries;
 } tvbox_i8xx_info;
 
 /* driver ioctls */
@@ -55,6 +61,292 @@ struct tvbox_i8xx_info {
 #define TVBOX_I8XX_SET_VGA_BIOS_PGTABLE		_IO ('I', 0x03)
 /* --- instruct driver to make allocated pgtable the active buffer -- DISABLED */
 #define TVBOX_I8XX_PGTABLE_ACTIVATE		_IO ('I', 0x04)
+/* --- write a batch of scattered GTT entries in one call. either pass an array of
+ *     (entry,pte) pairs, or leave pairs NULL and pass two parallel arrays.
+ *     every entry is checked against the table size before anything is written.
+ *     returns the number of entries written. */
+struct tvbox_i8xx_gtt_entry {
+	unsigned int		entry;		/* GTT entry index, not byte offset */
+	unsigned int		pte;
+};
+
+struct tvbox_i8xx_scatter {
+	unsigned int			count;
+	struct tvbox_i8xx_gtt_entry	*pairs;
+	unsigned int			*entries;
+	unsigned int			*ptes;
+};
+#define TVBOX_I8XX_SCATTER			_IOW('I', 0x05, struct tvbox_i8xx_scatter)
+/* --- fill entries [start,start+count) from a generator, in the kernel:
+ *
+ *       pte(i) = (base + ((i / repeat) % period) * stride) | flags
+ *
+ *     stride == 0 repeats one PTE, repeat == 0 is taken as 1, period == 0 never wraps.
+ *     a linear mapping of contiguous memory is base=phys, stride=4096, flags=1.
+ *     returns the number of entries written. */
+struct tvbox_i8xx_fill {
+	unsigned int		start;
+	unsigned int		count;
+	unsigned int		base;
+	unsigned int		stride;
+	unsigned int		flags;
+	unsigned int		repeat;
+	unsigned int		period;
+};
+#define TVBOX_I8XX_FILL				_IOW('I', 0x06, struct tvbox_i8xx_fill)
+/* --- reload the driver's shadow copy of the GTT from the hardware (read() is served from
+ *     the shadow copy). returns the number of entries that were out of date */
+#define TVBOX_I8XX_SHADOW_SYNC			_IO ('I', 0x07)
+/* --- staged updates (arg: 1 = on, 0 = off). while on, write()/SCATTER/FILL only update the
+ *     driver's copy and mark the entries whose value actually changed. nothing reaches the
+ *     GTT until TVBOX_I8XX_COMMIT. turning staging off commits anything still pending */
+#define TVBOX_I8XX_SET_STAGED			_IO ('I', 0x08)
+/* --- write the changed entries out to the GTT, with one posting read at the end.
+ *     reports how much was actually written */
+struct tvbox_i8xx_commit {
+	unsigned int		entries;
+	unsigned int		bytes;
+};
+#define TVBOX_I8XX_COMMIT			_IOR('I', 0x09, struct tvbox_i8xx_commit)
+/* --- queue a batch of GTT writes (same layout as TVBOX_I8XX_SCATTER, at most 4096 entries)
+ *     to be applied during the next vertical blank, so the display never scans out a half
+ *     updated table. returns the batch's sequence number. poll() reports POLLIN once a
+ *     batch has completed since the last TVBOX_I8XX_QUEUE_STATUS. on chipsets whose
+ *     pipe registers the driver can't reach (512KB MMADR) batches go out right away */
+#define TVBOX_I8XX_QUEUE			_IOW('I', 0x0A, struct tvbox_i8xx_scatter)
+/* --- how far along the queue is. also acknowledges completions for poll() */
+struct tvbox_i8xx_queue_status {
+	unsigned int		submitted;	/* sequence number of the last batch queued */
+	unsigned int		completed;	/* sequence number of the last batch applied */
+};
+#define TVBOX_I8XX_QUEUE_STATUS			_IOR('I', 0x0B, struct tvbox_i8xx_queue_status)
+/* --- pin a page-aligned range of the caller's memory and map it into consecutive GTT
+ *     entries starting at 'entry'. returns the number of entries mapped. the pages stay
+ *     pinned until TVBOX_I8XX_UNBIND (arg: the same entry) or close.
+ *
+ *     NOTE: the chipset does not snoop the CPU cache. data written by the CPU must be
+ *           flushed (clflush, or written with non-temporal stores + sfence) before the
+ *           display can see it. */
+struct tvbox_i8xx_bind {
+	unsigned long		addr;
+	unsigned long		size;		/* bytes, multiple of the page size */
+	unsigned int		entry;
+};
+#define TVBOX_I8XX_BIND				_IOW('I', 0x0C, struct tvbox_i8xx_bind)
+#define TVBOX_I8XX_UNBIND			_IO ('I', 0x0D)
+/* --- registered buffers: pin a range of the caller's memory once, up front, and get back a
+ *     handle. the driver keeps the pages pinned and their PTEs precomputed, so mapping
+ *     pages [first,first+count) of it at GTT entry 'entry' with TVBOX_I8XX_MAP_BUFFER is
+ *     just a copy. mapping over part of another buffer's mapping replaces that part.
+ *     TVBOX_I8XX_UNREGISTER (arg: handle) puts the default layout back wherever the buffer
+ *     is still mapped and unpins it. close releases every buffer. the cache note on
+ *     TVBOX_I8XX_BIND applies here too */
+struct tvbox_i8xx_register {
+	unsigned long		addr;
+	unsigned long		size;		/* bytes, multiple of the page size */
+};
+#define TVBOX_I8XX_REGISTER			_IOW('I', 0x0E, struct tvbox_i8xx_register)
+
+struct tvbox_i8xx_map_buffer {
+	unsigned int		handle;
+	unsigned int		first;		/* first page of the buffer */
+	unsigned int		count;		/* pages */
+	unsigned int		entry;		/* GTT entry to put the first page at */
+};
+#define TVBOX_I8XX_MAP_BUFFER			_IOW('I', 0x0F, struct tvbox_i8xx_map_buffer)
+#define TVBOX_I8XX_UNREGISTER			_IO ('I', 0x10)
+/* --- aperture space allocator. TVBOX_I8XX_ALLOC finds 'count' free GTT entries (best fit,
+ *     starting on a multiple of 'align' entries, a power of two or 0) and returns the first
+ *     one in 'entry'. fails with ENOSPC if there is no room. the stolen memory part of the
+ *     default layout is never handed out. TVBOX_I8XX_FREE (arg: entry) gives a range back
+ *     and puts the default layout back in it. ranges are given back on close.
+ *
+ *     if the module is loaded with multi_client=1, several processes may have the device
+ *     open, and each may only write (write/SCATTER/FILL/QUEUE/BIND/MAP_BUFFER/mmap) inside
+ *     the ranges it allocated. anything else fails with EACCES. SET_DEFAULT_PGTABLE and
+ *     close then only restore the caller's ranges, and SET_VGA_BIOS_PGTABLE is refused */
+struct tvbox_i8xx_alloc {
+	unsigned int		count;
+	unsigned int		align;
+	unsigned int		entry;		/* out */
+};
+#define TVBOX_I8XX_ALLOC			_IOWR('I', 0x11, struct tvbox_i8xx_alloc)
+#define TVBOX_I8XX_FREE				_IO ('I', 0x12)
+
+/* one linear run of GTT entries: entry start+k holds (base + k*stride) | flags, for k < count.
+ * flags is the low 12 bits of the PTE (valid, type, and on the 965 address bits 35:32).
+ * a default table is only two of these */
+struct tvbox_i8xx_extent {
+	unsigned int		start;
+	unsigned int		count;
+	unsigned int		base;
+	unsigned int		stride;
+	unsigned int		flags;
+};
+
+/* --- snapshot entries [start,start+count) of the table (count 0: to the end) into kernel memory,
+ *     stored as extents. returns the slot in 'slot' and how many extents it took in 'extents'.
+ *     TVBOX_I8XX_SNAPSHOT_RESTORE (arg: slot) writes it back, TVBOX_I8XX_SNAPSHOT_DROP (arg: slot)
+ *     frees it. a client may hold 16 snapshots, they go away on close. restoring needs the
+ *     same write access to the range as any other write. snapshots are raw PTEs: one taken while
+ *     a buffer was bound points at that buffer's pages even after it's unbound */
+struct tvbox_i8xx_snapshot {
+	unsigned int		start;
+	unsigned int		count;
+	unsigned int		slot;		/* out */
+	unsigned int		extents;	/* out */
+};
+#define TVBOX_I8XX_SNAPSHOT			_IOWR('I', 0x13, struct tvbox_i8xx_snapshot)
+#define TVBOX_I8XX_SNAPSHOT_RESTORE		_IO ('I', 0x14)
+#define TVBOX_I8XX_SNAPSHOT_DROP		_IO ('I', 0x15)
+
+/* --- read entries [start,start+count) of the table (count 0: to the end) as extents, at most
+ *     'max' of them into 'extents'. returns how many, and sets 'next' to the first entry not
+ *     covered (start+count once everything fit). call again from 'next' for the rest.
+ *     served from the driver's shadow copy, so it costs no MMIO reads */
+struct tvbox_i8xx_dump {
+	unsigned int			start;
+	unsigned int			count;
+	unsigned int			max;
+	struct tvbox_i8xx_extent	*extents;
+	unsigned int			next;		/* out */
+};
+#define TVBOX_I8XX_DUMP				_IOWR('I', 0x16, struct tvbox_i8xx_dump)
+
+/* --- copy 'count' entries from 'src' to 'dst', memmove() style (the ranges may overlap). done from
+ *     the driver's copy of the table, written through with one flush at the end (staged mode doesn't
+ *     apply). the source is left as it was. both ranges must be writable by the caller. copies of
+ *     bound or registered buffer pages count as mappings of that buffer: UNBIND/UNREGISTER take
+ *     them out of the GTT too. returns count */
+struct tvbox_i8xx_copy {
+	unsigned int		src;
+	unsigned int		dst;
+	unsigned int		count;
+};
+#define TVBOX_I8XX_COPY				_IOW('I', 0x17, struct tvbox_i8xx_copy)
+
+/* --- ring buffer mirror: entries [entry,entry+count) are repeated 'copies' times in a row (0 means 2,
+ *     the ring plus one mirror), so a ring of 'count' pages can be read or written past its end
+ *     without wrapping. the copies are written like TVBOX_I8XX_COPY, and are just as much mappings
+ *     of any buffer pages in the ring. the whole span must be writable by the caller. remap or
+ *     change the ring, then mirror again. returns the number of entries written */
+struct tvbox_i8xx_mirror {
+	unsigned int		entry;
+	unsigned int		count;
+	unsigned int		copies;
+};
+#define TVBOX_I8XX_MIRROR			_IOW('I', 0x18, struct tvbox_i8xx_mirror)
+/* --- buffers from the driver's page pool: system memory that was made write-combining
+ *     (uncached with pool_uc=1) when the pool was filled, so no cache attributes change
+ *     here. the pool starts at pool_pages pages and grows in bulk when it runs dry.
+ *     returns a handle that works like a TVBOX_I8XX_REGISTER one (MAP_BUFFER, COPY, ...),
+ *     and the buffer can be mmap()ed at TVBOX_I8XX_MMAP_BUFFER. TVBOX_I8XX_POOL_FREE
+ *     (arg: handle) is TVBOX_I8XX_UNREGISTER; the pages return to the pool once they are
+ *     out of the GTT and no longer mmap()ed. no cache flushing is needed for these */
+struct tvbox_i8xx_pool_alloc {
+	unsigned long		size;		/* bytes, multiple of the page size */
+};
+#define TVBOX_I8XX_POOL_ALLOC			_IOW('I', 0x19, struct tvbox_i8xx_pool_alloc)
+#define TVBOX_I8XX_POOL_FREE			TVBOX_I8XX_UNREGISTER
+/* --- one physically contiguous buffer, for capture DMA. it sits in the GTT as a single
+ *     linear run starting at 'entry' (TVBOX_I8XX_NO_ENTRY: not mapped yet, use
+ *     TVBOX_I8XX_MAP_BUFFER later). 'phys' returns its physical address. otherwise the same
+ *     as a pool buffer: same caching, mmap() at TVBOX_I8XX_MMAP_BUFFER, free with
+ *     TVBOX_I8XX_UNREGISTER. it comes from the kernel's page allocator, so the largest is
+ *     2^(MAX_ORDER-1) pages (4MB on x86), and a fragmented system may fail with ENOMEM
+ *     well below that. returns the handle */
+struct tvbox_i8xx_contig_alloc {
+	unsigned long		size;		/* bytes, multiple of the page size */
+	unsigned int		entry;
+	unsigned long long	phys;		/* out */
+};
+#define TVBOX_I8XX_NO_ENTRY			0xFFFFFFFFU
+#define TVBOX_I8XX_CONTIG_ALLOC			_IOWR('I', 0x1A, struct tvbox_i8xx_contig_alloc)
+/* --- a piece of the memory the BIOS stole for graphics, for cursors, OSD planes and small
+ *     overlays. sizes are rounded up to a power of two pages. the console framebuffer
+ *     (see the stolen_reserve parameter) and the BIOS page table are never handed out.
+ *     'offset' returns where in stolen memory it is. like TVBOX_I8XX_CONTIG_ALLOC
+ *     otherwise, except the CPU can't get at stolen memory directly: mmap() the aperture
+ *     (TVBOX_I8XX_MMAP_APERTURE) where it's mapped, not TVBOX_I8XX_MMAP_BUFFER. the
+ *     contents start out as whatever was there. returns the handle */
+struct tvbox_i8xx_stolen_alloc {
+	unsigned long		size;		/* bytes, multiple of the page size */
+	unsigned int		entry;
+	unsigned long		offset;		/* out */
+};
+#define TVBOX_I8XX_STOLEN_ALLOC			_IOWR('I', 0x1B, struct tvbox_i8xx_stolen_alloc)
+/* --- 2D blits on the GPU. these chipsets have no separate blitter ring, the 2D engine takes
+ *     its commands through the render ring, which the driver runs when loaded with
+ *     blt_ring=1 (with blt_mock=1 a software model of the ring stands in: nothing reaches
+ *     the GPU, not even the GTT or HWS_PGA, and blits are only stepped over. the checks and
+ *     ring bookkeeping live in tvbox_9xx_blt.h, which test_blt runs on the build host).
+ *     'cmds' is 'count' dwords (at most 1024) of XY_COLOR_BLT, XY_SRC_COPY_BLT and MI_NOOP,
+ *     nothing else: linear surfaces, positive pitch and coordinates, and every byte a blit
+ *     touches must be aperture space the client owns. the commands are copied into the
+ *     ring behind a flush and a store of the batch's sequence number into dword
+ *     TVBOX_I8XX_HWS_SEQNO of the status page. the batch is done once that dword has
+ *     reached 'seqno' (compare as a signed difference, it wraps). TVBOX_I8XX_BLT_WAIT
+ *     (arg: seqno) sleeps until then, ETIMEDOUT means the GPU is stuck. ENODEV if the ring
+ *     isn't running */
+struct tvbox_i8xx_blt {
+	const uint32_t*		cmds;
+	unsigned int		count;
+	unsigned int		seqno;		/* out */
+};
+#define TVBOX_I8XX_BLT				_IOWR('I', 0x1C, struct tvbox_i8xx_blt)
+#define TVBOX_I8XX_BLT_WAIT			_IO ('I', 0x1D)
+#define TVBOX_I8XX_HWS_SEQNO			0x20
+/*     first dwords of the blits (OR in TVBOX_I8XX_XY_BLT_WRITE_RGBA for 32bpp):
+ *       XY_COLOR_BLT:    cmd, BR13 (depth 25:24, ROP 23:16, pitch 15:0), y1:x1, y2:x2, dst, color
+ *       XY_SRC_COPY_BLT: cmd, BR13, y1:x1, y2:x2, dst, src y1:x1, src pitch, src */
+#define TVBOX_I8XX_XY_COLOR_BLT			((2U << 29) | (0x50 << 22) | 4)
+#define TVBOX_I8XX_XY_SRC_COPY_BLT		((2U << 29) | (0x53 << 22) | 6)
+#define TVBOX_I8XX_XY_BLT_WRITE_RGBA		(3U << 20)
+
+/* mmap() offsets. the upper bits of the offset select what is mapped, the
+ * rest is the byte offset within that region.
+ *
+ * TVBOX_I8XX_MMAP_GTT maps the GTT window (the upper half of the MMIO BAR)
+ * write-combining, one 32-bit PTE per aperature page. This is the fast path:
+ * stores are gathered by the CPU and no syscall is needed per entry. The
+ * catch is that write-combined stores are posted, and may be held in the CPU
+ * and arrive in any order. The rule is:
+ *
+ *   1. make all the stores for the update
+ *   2. sfence (e.g. __sync_synchronize()) to drain the write-combining buffers
+ *   3. read back one entry you wrote (posting read). once that read returns,
+ *      the chipset has seen every store made before the fence.
+ *
+ * Do not assume the display sees any of the update before step 3 completes,
+ * and do not assume it sees them in the order you wrote them.
+ *
+ * TVBOX_I8XX_MMAP_GTT_UC maps the same window uncached. Every store goes out
+ * immediately and in order, at uncached speed. Use it if you can't follow the
+ * rule above. Reads through either mapping are slow uncached MMIO reads.
+ * The driver itself maps the window write-combining unless loaded with
+ * gtt_wc=0, and PAT can't give the same range two cache types, so while it
+ * does mmap of TVBOX_I8XX_MMAP_GTT_UC fails with EBUSY.
+ *
+ * TVBOX_I8XX_MMAP_APERTURE maps the graphics aperture itself, write-combining,
+ * for uploading frames. The offset within it is GTT entry * 4096, and the
+ * mapping must be MAP_SHARED. In multi_client mode it may only cover entries
+ * the client allocated, and TVBOX_I8XX_FREE takes the pages away again
+ * (touching them afterwards is SIGBUS), as it does for the GTT window.
+ *
+ * TVBOX_I8XX_MMAP_BUFFER + handle * 4096 maps a pool or contiguous buffer
+ * (TVBOX_I8XX_POOL_ALLOC, TVBOX_I8XX_CONTIG_ALLOC) from its first page, with
+ * the same caching the pool uses. Registered user memory can't be mapped this
+ * way, the caller has it mapped already.
+ *
+ * TVBOX_I8XX_MMAP_HWS maps the hardware status page (GINFO hwst_base), read-only,
+ * one page at offset 0. It's ordinary cached memory the chipset writes into, so
+ * polling it costs no MMIO reads. */
+#define TVBOX_I8XX_MMAP_REGION_MASK		0x70000000UL
+#define TVBOX_I8XX_MMAP_GTT			0x00000000UL
+#define TVBOX_I8XX_MMAP_GTT_UC			0x10000000UL
+#define TVBOX_I8XX_MMAP_APERTURE		0x20000000UL
+#define TVBOX_I8XX_MMAP_HWS			0x30000000UL
+#define TVBOX_I8XX_MMAP_BUFFER			0x40000000UL
 
 #define TVBOX_I8XX_MINOR	248
 
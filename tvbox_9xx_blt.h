@@ -0,0 +1,155 @@
+#ifndef __TVBOX_I8XX_BLT_H
+#define __TVBOX_I8XX_BLT_H
+
+/* TVBOX_I8XX_BLT command checking and ring bookkeeping, kept free of anything kernel so
+ * test_blt can run the same code on the build host. include it after tvbox_9xx.h, with
+ * uint32_t/int16_t/uint64_t and EINVAL/EACCES already defined (<linux/types.h> and
+ * <linux/errno.h> in the driver, <stdint.h> and <errno.h> in userspace) */
+
+#define MI_NOOP			0
+#define MI_FLUSH		(0x04 << 23)
+#define MI_STORE_DWORD_INDEX	((0x21 << 23) | 1)
+
+#define BLT_MAX_DWORDS		1024
+
+/* what a blit may touch: aperture pages below 'entries', none of the driver's own
+ * [drv_first,drv_first+drv_entries), and only what owns() says belongs to the client */
+struct blt_limits {
+	unsigned int		entries;
+	unsigned int		drv_first;
+	unsigned int		drv_entries;
+	int			(*owns)(void *ctx,unsigned int first,unsigned int count);
+	void			*ctx;
+};
+
+/* may a blit touch [base + y*pitch + x*cpp, base + (y+h-1)*pitch + (x+w)*cpp)? GTT pages
+ * are 4KB whatever the CPU uses */
+static inline int blt_region_ok(const struct blt_limits *l,uint32_t base,int pitch,int x,int y,int w,int h,unsigned int cpp) {
+	unsigned int first,last;
+	uint64_t start,end;
+
+	if (pitch <= 0 || x < 0 || y < 0 || w <= 0 || h <= 0)
+		return 0;
+
+	start = (uint64_t)base + ((uint64_t)y * pitch) + ((uint64_t)x * cpp);
+	end = (uint64_t)base + ((uint64_t)(y + h - 1) * pitch) + ((uint64_t)(x + w) * cpp);
+	if (end > ((uint64_t)l->entries << 12))
+		return 0;
+
+	first = (unsigned int)(start >> 12);
+	last = (unsigned int)((end - 1) >> 12);
+	if (first < (l->drv_first + l->drv_entries) && last >= l->drv_first)
+		return 0;
+
+	return l->owns(l->ctx,first,last + 1 - first);
+}
+
+/* only blits and MI_NOOP get into the ring, and only onto the client's own surfaces.
+ * 0, -EINVAL for anything that isn't one of those, -EACCES for a surface out of bounds */
+static inline long blt_check(const struct blt_limits *l,const uint32_t *c,unsigned int count) {
+	static const unsigned int blt_cpp[4] = { 1, 2, 2, 4 };
+	unsigned int i,len,cpp;
+	int x1,y1,x2,y2;
+
+	for (i=0;i < count;i += len) {
+		uint32_t cmd = c[i] & ~TVBOX_I8XX_XY_BLT_WRITE_RGBA;
+
+		if (c[i] == MI_NOOP) {
+			len = 1;
+			continue;
+		}
+
+		/* anything else, tiled surfaces included, doesn't match */
+		if (cmd == TVBOX_I8XX_XY_COLOR_BLT)
+			len = 6;
+		else if (cmd == TVBOX_I8XX_XY_SRC_COPY_BLT)
+			len = 8;
+		else
+			return -EINVAL;
+
+		if (len > (count - i))
+			return -EINVAL;
+
+		cpp = blt_cpp[(c[i+1] >> 24) & 3];
+		x1 = (int16_t)(c[i+2] & 0xFFFF);
+		y1 = (int16_t)(c[i+2] >> 16);
+		x2 = (int16_t)(c[i+3] & 0xFFFF);
+		y2 = (int16_t)(c[i+3] >> 16);
+
+		if (!blt_region_ok(l,c[i+4],(int16_t)(c[i+1] & 0xFFFF),x1,y1,x2 - x1,y2 - y1,cpp))
+			return -EACCES;
+
+		if (cmd == TVBOX_I8XX_XY_SRC_COPY_BLT &&
+			!blt_region_ok(l,c[i+7],(int16_t)(c[i+6] & 0xFFFF),(int16_t)(c[i+5] & 0xFFFF),
+				(int16_t)(c[i+5] >> 16),x2 - x1,y2 - y1,cpp))
+			return -EACCES;
+	}
+
+	return 0;
+}
+
+/* the ring as the CPU writes it. size in bytes, a power of two. offsets are bytes too,
+ * like the HEAD and TAIL registers */
+struct blt_ring {
+	uint32_t		*virt;
+	unsigned int		size;
+	unsigned int		tail;
+};
+
+/* will n dwords fit at the tail with the GPU at 'head'? a run that won't fit before the end
+ * goes to the start, so that counts the MI_NOOPs in front of it. the tail stays a qword
+ * short of the head, or a full ring would look empty */
+static inline int blt_ring_room(const struct blt_ring *r,unsigned int head,unsigned int n) {
+	unsigned int need = n << 2;
+	int space;
+
+	if ((r->tail + need) > r->size)
+		need += r->size - r->tail;
+
+	space = (int)head - (int)(r->tail + 8);
+	if (space < 0)
+		space += r->size;
+
+	return space >= (int)need;
+}
+
+/* make room for n dwords in one run, once blt_ring_room() said there is */
+static inline void blt_ring_wrap(struct blt_ring *r,unsigned int n) {
+	if ((r->tail + (n << 2)) <= r->size)
+		return;
+
+	while (r->tail < r->size) {
+		r->virt[r->tail >> 2] = MI_NOOP;
+		r->tail += 4;
+	}
+	r->tail = 0;
+}
+
+static inline void blt_ring_emit(struct blt_ring *r,uint32_t v) {
+	r->virt[r->tail >> 2] = v;
+	r->tail = (r->tail + 4) & (r->size - 1);
+}
+
+/* a software command streamer (blt_mock): run the ring from head to tail and return the new
+ * head. blits are only stepped over, sequence number stores land in hws like the real thing */
+static inline unsigned int blt_ring_execute(const struct blt_ring *r,unsigned int head,unsigned int tail,uint32_t *hws) {
+	while (head != tail) {
+		uint32_t cmd = r->virt[head >> 2];
+		unsigned int len = 1;
+
+		if ((cmd >> 29) == 2) {
+			len = (cmd & 0xFF) + 2;
+		}
+		else if (cmd == MI_STORE_DWORD_INDEX) {
+			hws[(r->virt[((head + 4) & (r->size - 1)) >> 2] & 0xFFC) >> 2] =
+				r->virt[((head + 8) & (r->size - 1)) >> 2];
+			len = 3;
+		}
+
+		head = (head + (len << 2)) & (r->size - 1);
+	}
+
+	return head;
+}
+
+#endif /* TVBOX_I8XX_BLT_H */